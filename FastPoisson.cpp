@@ -0,0 +1,297 @@
+#include "FastPoisson.h"
+#include "ThreadTeam.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+typedef std::complex<double> Complex;
+
+// Rows of the grid transformed together, so the strided reads use whole cache lines.
+static const int RowBlock = 8;
+
+// Odd factors up to this are split off with plain DFTs, the rest of the length goes to
+// Bluestein's algorithm.
+static const int SmallFactor = 16;
+
+static int smallestFactor(int len)
+{
+    for(int p = 2; p * p <= len; p++)
+        if (len % p == 0) return p;
+    return len;
+}
+
+// out[k] = sum_j in[j*stride] e^(-2 pi i j k/len) for a power of two len, where twiddle[k]
+// = e^(-2 pi i k/N) and len divides N.  Recursive radix 2 decimation in time.
+static void radix2(const Complex *in, Complex *out, int len, int stride, const Complex *twiddle, int N)
+{
+    if (len == 1)
+    {
+        out[0] = in[0];
+        return;
+    }
+    if (len == 2)
+    {
+        out[0] = in[0] + in[stride];
+        out[1] = in[0] - in[stride];
+        return;
+    }
+    int step = N / len;
+    int half = len / 2;
+    radix2(in, out, half, 2 * stride, twiddle, N);
+    radix2(in + stride, out + half, half, 2 * stride, twiddle, N);
+    for(int k = 0; k < half; k++)
+    {
+        Complex t = twiddle[k*step] * out[k + half];
+        out[k + half] = out[k] - t;
+        out[k] += t;
+    }
+}
+
+void SineTransform::Setup(int length)
+{
+    n = length;
+    N = n + 1;
+    twiddle.resize(N);
+    sines.resize(N);
+    for(int k = 0; k < N; k++)
+    {
+        twiddle[k] = std::polar(1.0, -2.0 * M_PI * k / N);
+        sines[k] = std::sin(M_PI * k / N);
+    }
+
+    // What is left of N after the factors the recursion in FFT() splits off
+    L = N;
+    for(int p = smallestFactor(L); L > 1 && p <= SmallFactor; p = smallestFactor(L))
+        L /= p;
+    chirpLength = 0;
+    chirp.clear();
+    chirpKernel.clear();
+    chirpTwiddle.clear();
+    if (L == 1) return;
+    chirpLength = 1;
+    while (chirpLength < 2*L - 1)
+        chirpLength *= 2;
+    chirp.resize(L);
+    for(int j = 0; j < L; j++)
+        chirp[j] = std::polar(1.0, -M_PI * double(long(j) * j % (2*L)) / L);    // j^2 mod 2L keeps the angle exact
+    chirpTwiddle.resize(chirpLength);
+    for(int k = 0; k < chirpLength; k++)
+        chirpTwiddle[k] = std::polar(1.0, -2.0 * M_PI * k / chirpLength);
+    std::vector<Complex> b(chirpLength, Complex(0));
+    for(int j = 0; j < L; j++)
+    {
+        b[j] = std::conj(chirp[j]);
+        if (j > 0) b[chirpLength - j] = b[j];
+    }
+    chirpKernel.resize(chirpLength);
+    radix2(b.data(), chirpKernel.data(), chirpLength, 1, chirpTwiddle.data(), chirpLength);
+}
+
+// The DFT of length L with jk = (j^2 + k^2 - (k-j)^2)/2: X_k = c_k sum_j (x_j c_j) conj(c_(k-j))
+// for the chirp c, and the convolution is a product after the FFT.  The inverse FFT is the
+// conjugate of the FFT of the conjugate.
+void SineTransform::Bluestein(const Complex *in, Complex *out, int stride, Complex *scratch) const
+{
+    Complex *a = scratch;
+    Complex *A = scratch + chirpLength;
+    for(int j = 0; j < L; j++)
+        a[j] = in[j*stride] * chirp[j];
+    for(int j = L; j < chirpLength; j++)
+        a[j] = 0;
+    radix2(a, A, chirpLength, 1, chirpTwiddle.data(), chirpLength);
+    for(int k = 0; k < chirpLength; k++)
+        a[k] = std::conj(A[k] * chirpKernel[k]);
+    radix2(a, A, chirpLength, 1, chirpTwiddle.data(), chirpLength);
+    double scale = 1.0 / chirpLength;
+    for(int k = 0; k < L; k++)
+        out[k] = chirp[k] * std::conj(A[k]) * scale;
+}
+
+// out[k] = sum_j in[j*stride] e^(-2 pi i j k/len), where len divides N.  Recursive decimation
+// in time by the smallest factor of the length, radix 2 or a plain DFT of an odd factor up to
+// SmallFactor, until only the part for Bluestein's algorithm is left.
+void SineTransform::FFT(const Complex *in, Complex *out, int len, int stride, Complex *scratch) const
+{
+    int step = N / len;     // twiddle[k*step] = e^(-2 pi i k/len)
+    if (len == 1)
+    {
+        out[0] = in[0];
+        return;
+    }
+    if (len == 2)
+    {
+        out[0] = in[0] + in[stride];
+        out[1] = in[0] - in[stride];
+        return;
+    }
+    int p = smallestFactor(len);
+    if (p > SmallFactor)
+    {
+        Bluestein(in, out, stride, scratch);
+        return;
+    }
+    int m = len / p;
+    for(int r = 0; r < p; r++)
+        FFT(in + r*stride, out + r*m, m, p * stride, scratch);
+    if (p == 2)
+    {
+        for(int k = 0; k < m; k++)
+        {
+            Complex t = twiddle[k*step] * out[k + m];
+            out[k + m] = out[k] - t;
+            out[k] += t;
+        }
+        return;
+    }
+    // out[k + q*m] = sum_r e^(-2 pi i r(k + q*m)/len) F_r[k], a DFT of length p for every k
+    Complex t[SmallFactor];
+    int stepP = N / p;
+    for(int k = 0; k < m; k++)
+    {
+        for(int r = 0; r < p; r++)
+            t[r] = twiddle[r*k*step] * out[k + r*m];
+        for(int q = 0; q < p; q++)
+        {
+            Complex sum = 0;
+            for(int r = 0; r < p; r++)
+                sum += t[r] * twiddle[(r*q % p) * stepP];
+            out[k + q*m] = sum;
+        }
+    }
+}
+
+// The sine transform from a real FFT of the same length (Numerical Recipes, sinft): the line
+// is folded into y_j = sin(pi j/N)(f_j + f_{N-j}) + (f_j - f_{N-j})/2, whose cosine sums R_k
+// and sine sums I_k give X_{2k} = I_k and X_{2k+1} = X_{2k-1} + R_k, with X_1 = R_0/2.  The
+// two lines are the real and imaginary parts of one complex FFT.
+void SineTransform::Apply(double *a, double *b, Complex *work) const
+{
+    if (n == 0) return;
+    Complex *z = work;
+    Complex *Z = work + N;
+    z[0] = 0;
+    for(int j = 1; j < N; j++)
+    {
+        // f_j is a[j-1]
+        double fa = a[j-1], ra = a[N-j-1];
+        double ya = sines[j] * (fa + ra) + 0.5 * (fa - ra);
+        double yb = 0;
+        if (b != nullptr)
+        {
+            double fb = b[j-1], rb = b[N-j-1];
+            yb = sines[j] * (fb + rb) + 0.5 * (fb - rb);
+        }
+        z[j] = Complex(ya, yb);
+    }
+    FFT(z, Z, N, 1, work + 2*N);
+
+    double oddA = 0, oddB = 0;
+    for(int k = 0; 2*k < N; k++)
+    {
+        // Split into the FFTs of the two real lines, Y = R - iI
+        Complex conjugate = std::conj(Z[(N - k) % N]);
+        Complex Ya = 0.5 * (Z[k] + conjugate);
+        Complex Yb = Complex(0, -0.5) * (Z[k] - conjugate);
+        if (k == 0)
+        {
+            oddA = 0.5 * Ya.real();
+            oddB = 0.5 * Yb.real();
+        }
+        else
+        {
+            a[2*k - 1] = -Ya.imag();
+            oddA += Ya.real();
+            if (b != nullptr)
+            {
+                b[2*k - 1] = -Yb.imag();
+                oddB += Yb.real();
+            }
+        }
+        if (2*k + 1 < N)
+        {
+            a[2*k] = oddA;
+            if (b != nullptr) b[2*k] = oddB;
+        }
+    }
+}
+
+// Runs kernel(first, last) on a share of the lines 0..count-1 for every member of the team.
+static void splitLines(ThreadTeam *team, int count, const std::function<void(int, int)> &kernel)
+{
+    if (team == nullptr || team->Size() == 1)
+    {
+        kernel(0, count);
+        return;
+    }
+    int howManyThreads = team->Size();
+    team->Run([&](int t) {
+        kernel(count * t / howManyThreads, count * (t+1) / howManyThreads);
+    });
+}
+
+void FastPoissonSolver::Setup(int _m, int _n, double r)
+{
+    m = _m;
+    n = _n;
+    sx.Setup(m);
+    sy.Setup(n);
+    // The transforms in both directions are applied twice, which scales by (m+1)(n+1)/4
+    double scale = 4.0 / (double(m + 1) * double(n + 1));
+    eigenx.resize(m);
+    eigeny.resize(n);
+    for(int k = 0; k < m; k++)
+    {
+        double s = std::sin(0.5 * M_PI * (k + 1) / (m + 1));
+        eigenx[k] = 4.0 * s * s / scale;
+    }
+    for(int l = 0; l < n; l++)
+    {
+        double s = std::sin(0.5 * M_PI * (l + 1) / (n + 1));
+        eigeny[l] = 4.0 * r * s * s / scale;
+    }
+}
+
+void FastPoissonSolver::Solve(double *b, ThreadTeam *team) const
+{
+    if (m == 0 || n == 0) return;
+    // Columns are contiguous, two at a time
+    auto columns = [&](int j0, int j1) {
+        std::vector<Complex> work(sx.WorkSize());
+        for(int j = j0; j < j1; j += 2)
+            sx.Apply(b + long(j) * m, (j + 1 < j1) ? b + long(j + 1) * m : nullptr, work.data());
+    };
+    splitLines(team, n, columns);
+
+    // The rows are copied out in blocks, transformed, divided by the eigenvalues, transformed
+    // back and copied in again
+    splitLines(team, (m + RowBlock - 1) / RowBlock, [&](int block0, int block1) {
+        std::vector<Complex> work(sy.WorkSize());
+        std::vector<double> rows(RowBlock * long(n));
+        for(int block = block0; block < block1; block++)
+        {
+            int i0 = block * RowBlock;
+            int count = std::min(RowBlock, m - i0);
+            for(int j = 0; j < n; j++)
+                for(int r = 0; r < count; r++)
+                    rows[r * long(n) + j] = b[i0 + r + long(j) * m];
+            for(int r = 0; r < count; r += 2)
+            {
+                double *first = rows.data() + r * long(n);
+                double *second = (r + 1 < count) ? first + n : nullptr;
+                sy.Apply(first, second, work.data());
+                for(int j = 0; j < n; j++)
+                {
+                    first[j] /= eigenx[i0 + r] + eigeny[j];
+                    if (second != nullptr) second[j] /= eigenx[i0 + r + 1] + eigeny[j];
+                }
+                sy.Apply(first, second, work.data());
+            }
+            for(int j = 0; j < n; j++)
+                for(int r = 0; r < count; r++)
+                    b[i0 + r + long(j) * m] = rows[r * long(n) + j];
+        }
+    });
+
+    splitLines(team, n, columns);
+}
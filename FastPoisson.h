@@ -0,0 +1,74 @@
+#ifndef FastPoisson_H
+#define FastPoisson_H
+
+// Direct solver for the 5-point Laplacian with Dirichlet boundaries.  The sines are the
+// eigenvectors of the stencil, so a sine transform in both directions, a division by the
+// eigenvalues and the same transforms again solve the system in O(m n log(m n)).
+//
+// Use, for the interior points of an M x N grid with the boundary values moved to b:
+//   FastPoissonSolver fast;
+//   fast.Setup(M-2, N-2, dx*dx/(dy*dy));
+//   fast.Solve(b);    // b is (M-2) x (N-2), column-major, and is overwritten by the solution
+// which solves the system of laplacianMatrix(M, N, r) in main.cpp.
+//
+// The transforms use the FFT below, so no FFT library is needed.  It is fastest when m+1 and
+// n+1 are powers of two, splits off small odd factors as well, and does what is left of the
+// length with Bluestein's algorithm, so the cost is O(N log N) for every length.
+
+#include <complex>
+#include <vector>
+
+class ThreadTeam;
+
+// X_k = sum_{j=1..n} x_j sin(pi j k / (n+1)) for k = 1..n.  Applying it twice gives
+// (n+1)/2 times the input.
+class SineTransform
+{
+public:
+    SineTransform() : n(0), N(0), L(1), chirpLength(0) {}
+
+    void Setup(int n);
+    int Length(void) const {return n;}
+
+    // Transforms the lines a and b of length n in place, b can be nullptr.  work has to
+    // hold WorkSize() values.
+    void Apply(double *a, double *b, std::complex<double> *work) const;
+    int WorkSize(void) const {return 2 * N + 2 * chirpLength;}
+
+private:
+    void FFT(const std::complex<double> *in, std::complex<double> *out, int len, int stride, std::complex<double> *scratch) const;
+    void Bluestein(const std::complex<double> *in, std::complex<double> *out, int stride, std::complex<double> *scratch) const;
+
+    int n;
+    int N;      // n+1, the length of the FFT
+    std::vector<std::complex<double> > twiddle;     // e^(-2 pi i k/N)
+    std::vector<double> sines;                      // sin(pi j/N)
+
+    // Bluestein's algorithm for the part L of N without factors up to SmallFactor: the DFT of
+    // length L is a convolution with the chirp e^(-pi i j^2/L), done with FFTs of length
+    // chirpLength, the power of two from 2L-1 up.
+    int L;
+    int chirpLength;
+    std::vector<std::complex<double> > chirp;           // e^(-pi i j^2/L)
+    std::vector<std::complex<double> > chirpKernel;     // FFT of the conjugate chirp, wrapped around
+    std::vector<std::complex<double> > chirpTwiddle;    // e^(-2 pi i k/chirpLength)
+};
+
+class FastPoissonSolver
+{
+public:
+    FastPoissonSolver() : m(0), n(0) {}
+
+    // The system of -dx^2 * Laplacian on m x n unknowns, with r = dx^2/dy^2
+    void Setup(int m, int n, double r = 1.0);
+
+    // The lines are split across the team when one is given
+    void Solve(double *b, ThreadTeam *team = nullptr) const;
+
+private:
+    int m, n;
+    SineTransform sx, sy;
+    std::vector<double> eigenx, eigeny;     // the eigenvalues in x and y, with their scale
+};
+
+#endif
@@ -0,0 +1,283 @@
+#include "StencilKernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define STENCIL_X86 1
+#include <immintrin.h>
+#else
+#define STENCIL_X86 0
+#endif
+
+#pragma mark Scalar
+
+static void jacobiScalar(const double *ptr, double *ptr_new, const double *ptr_f, int M, int s, int i0, int i1, int j0, int j1, double h2, double omega)
+{
+    double nomega = 1 - omega;
+    double factor = 0.25;
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        double *out = ptr_new + j*M;
+        for(int i = i0; i < i1; i++)
+        {
+            out[i] = c[i] * nomega + ((c[i-s] + c[i+s] + l[i] + r[i] - f[i]*h2) * factor) * omega;
+        }
+    }
+}
+
+static double residualNormScalar(const double *ptr, const double *ptr_f, int M, int j0, int j1, double invh2)
+{
+    double norm = 0;
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        for(int i = 1; i < M-1; i++)
+        {
+            norm = std::max(norm, std::fabs(f[i] - (c[i-1] + c[i+1] + l[i] + r[i] - c[i] * 4.0) * invh2));
+        }
+    }
+    return norm;
+}
+
+static const StencilKernels ScalarKernels = {"scalar", jacobiScalar, residualNormScalar};
+
+#if STENCIL_X86
+
+#pragma mark SSE2
+
+__attribute__((target("sse2")))
+static void jacobiSSE2(const double *ptr, double *ptr_new, const double *ptr_f, int M, int s, int i0, int i1, int j0, int j1, double h2, double omega)
+{
+    double nomega = 1 - omega;
+    double factor = 0.25;
+    __m128d vnomega = _mm_set1_pd(nomega), vfactor = _mm_set1_pd(factor), vomega = _mm_set1_pd(omega), vh2 = _mm_set1_pd(h2);
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        double *out = ptr_new + j*M;
+        int i = i0;
+        for(; i + 2 <= i1; i += 2)
+        {
+            __m128d sum = _mm_add_pd(_mm_loadu_pd(c + i - s), _mm_loadu_pd(c + i + s));
+            sum = _mm_add_pd(sum, _mm_loadu_pd(l + i));
+            sum = _mm_add_pd(sum, _mm_loadu_pd(r + i));
+            sum = _mm_sub_pd(sum, _mm_mul_pd(_mm_loadu_pd(f + i), vh2));
+            __m128d relaxed = _mm_mul_pd(_mm_mul_pd(sum, vfactor), vomega);
+            _mm_storeu_pd(out + i, _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(c + i), vnomega), relaxed));
+        }
+        for(; i < i1; i++)
+        {
+            out[i] = c[i] * nomega + ((c[i-s] + c[i+s] + l[i] + r[i] - f[i]*h2) * factor) * omega;
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+static double residualNormSSE2(const double *ptr, const double *ptr_f, int M, int j0, int j1, double invh2)
+{
+    __m128d vinvh2 = _mm_set1_pd(invh2), vfour = _mm_set1_pd(4.0), vsign = _mm_set1_pd(-0.0);
+    __m128d vnorm = _mm_setzero_pd();
+    double norm = 0;
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        int i = 1;
+        for(; i + 2 <= M-1; i += 2)
+        {
+            __m128d sum = _mm_add_pd(_mm_loadu_pd(c + i - 1), _mm_loadu_pd(c + i + 1));
+            sum = _mm_add_pd(sum, _mm_loadu_pd(l + i));
+            sum = _mm_add_pd(sum, _mm_loadu_pd(r + i));
+            sum = _mm_sub_pd(sum, _mm_mul_pd(_mm_loadu_pd(c + i), vfour));
+            __m128d res = _mm_sub_pd(_mm_loadu_pd(f + i), _mm_mul_pd(sum, vinvh2));
+            vnorm = _mm_max_pd(vnorm, _mm_andnot_pd(vsign, res));
+        }
+        for(; i < M-1; i++)
+        {
+            norm = std::max(norm, std::fabs(f[i] - (c[i-1] + c[i+1] + l[i] + r[i] - c[i] * 4.0) * invh2));
+        }
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, vnorm);
+    for(int k = 0; k < 2; k++)
+        norm = std::max(norm, lanes[k]);
+    return norm;
+}
+
+static const StencilKernels SSE2Kernels = {"sse2", jacobiSSE2, residualNormSSE2};
+
+#pragma mark AVX2
+
+__attribute__((target("avx2")))
+static void jacobiAVX2(const double *ptr, double *ptr_new, const double *ptr_f, int M, int s, int i0, int i1, int j0, int j1, double h2, double omega)
+{
+    double nomega = 1 - omega;
+    double factor = 0.25;
+    __m256d vnomega = _mm256_set1_pd(nomega), vfactor = _mm256_set1_pd(factor), vomega = _mm256_set1_pd(omega), vh2 = _mm256_set1_pd(h2);
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        double *out = ptr_new + j*M;
+        int i = i0;
+        for(; i + 4 <= i1; i += 4)
+        {
+            __m256d sum = _mm256_add_pd(_mm256_loadu_pd(c + i - s), _mm256_loadu_pd(c + i + s));
+            sum = _mm256_add_pd(sum, _mm256_loadu_pd(l + i));
+            sum = _mm256_add_pd(sum, _mm256_loadu_pd(r + i));
+            sum = _mm256_sub_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(f + i), vh2));
+            __m256d relaxed = _mm256_mul_pd(_mm256_mul_pd(sum, vfactor), vomega);
+            _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(c + i), vnomega), relaxed));
+        }
+        for(; i < i1; i++)
+        {
+            out[i] = c[i] * nomega + ((c[i-s] + c[i+s] + l[i] + r[i] - f[i]*h2) * factor) * omega;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static double residualNormAVX2(const double *ptr, const double *ptr_f, int M, int j0, int j1, double invh2)
+{
+    __m256d vinvh2 = _mm256_set1_pd(invh2), vfour = _mm256_set1_pd(4.0), vsign = _mm256_set1_pd(-0.0);
+    __m256d vnorm = _mm256_setzero_pd();
+    double norm = 0;
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        int i = 1;
+        for(; i + 4 <= M-1; i += 4)
+        {
+            __m256d sum = _mm256_add_pd(_mm256_loadu_pd(c + i - 1), _mm256_loadu_pd(c + i + 1));
+            sum = _mm256_add_pd(sum, _mm256_loadu_pd(l + i));
+            sum = _mm256_add_pd(sum, _mm256_loadu_pd(r + i));
+            sum = _mm256_sub_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(c + i), vfour));
+            __m256d res = _mm256_sub_pd(_mm256_loadu_pd(f + i), _mm256_mul_pd(sum, vinvh2));
+            vnorm = _mm256_max_pd(vnorm, _mm256_andnot_pd(vsign, res));
+        }
+        for(; i < M-1; i++)
+        {
+            norm = std::max(norm, std::fabs(f[i] - (c[i-1] + c[i+1] + l[i] + r[i] - c[i] * 4.0) * invh2));
+        }
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, vnorm);
+    for(int k = 0; k < 4; k++)
+        norm = std::max(norm, lanes[k]);
+    return norm;
+}
+
+static const StencilKernels AVX2Kernels = {"avx2", jacobiAVX2, residualNormAVX2};
+
+#pragma mark AVX-512
+
+__attribute__((target("avx512f")))
+static void jacobiAVX512(const double *ptr, double *ptr_new, const double *ptr_f, int M, int s, int i0, int i1, int j0, int j1, double h2, double omega)
+{
+    double nomega = 1 - omega;
+    double factor = 0.25;
+    __m512d vnomega = _mm512_set1_pd(nomega), vfactor = _mm512_set1_pd(factor), vomega = _mm512_set1_pd(omega), vh2 = _mm512_set1_pd(h2);
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        double *out = ptr_new + j*M;
+        int i = i0;
+        for(; i + 8 <= i1; i += 8)
+        {
+            __m512d sum = _mm512_add_pd(_mm512_loadu_pd(c + i - s), _mm512_loadu_pd(c + i + s));
+            sum = _mm512_add_pd(sum, _mm512_loadu_pd(l + i));
+            sum = _mm512_add_pd(sum, _mm512_loadu_pd(r + i));
+            sum = _mm512_sub_pd(sum, _mm512_mul_pd(_mm512_loadu_pd(f + i), vh2));
+            __m512d relaxed = _mm512_mul_pd(_mm512_mul_pd(sum, vfactor), vomega);
+            _mm512_storeu_pd(out + i, _mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(c + i), vnomega), relaxed));
+        }
+        for(; i < i1; i++)
+        {
+            out[i] = c[i] * nomega + ((c[i-s] + c[i+s] + l[i] + r[i] - f[i]*h2) * factor) * omega;
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static double residualNormAVX512(const double *ptr, const double *ptr_f, int M, int j0, int j1, double invh2)
+{
+    __m512d vinvh2 = _mm512_set1_pd(invh2), vfour = _mm512_set1_pd(4.0);
+    __m512d vnorm = _mm512_setzero_pd();
+    double norm = 0;
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        int i = 1;
+        for(; i + 8 <= M-1; i += 8)
+        {
+            __m512d sum = _mm512_add_pd(_mm512_loadu_pd(c + i - 1), _mm512_loadu_pd(c + i + 1));
+            sum = _mm512_add_pd(sum, _mm512_loadu_pd(l + i));
+            sum = _mm512_add_pd(sum, _mm512_loadu_pd(r + i));
+            sum = _mm512_sub_pd(sum, _mm512_mul_pd(_mm512_loadu_pd(c + i), vfour));
+            __m512d res = _mm512_sub_pd(_mm512_loadu_pd(f + i), _mm512_mul_pd(sum, vinvh2));
+            vnorm = _mm512_max_pd(vnorm, _mm512_abs_pd(res));
+        }
+        for(; i < M-1; i++)
+        {
+            norm = std::max(norm, std::fabs(f[i] - (c[i-1] + c[i+1] + l[i] + r[i] - c[i] * 4.0) * invh2));
+        }
+    }
+    double lanes[8];
+    _mm512_storeu_pd(lanes, vnorm);
+    for(int k = 0; k < 8; k++)
+        norm = std::max(norm, lanes[k]);
+    return norm;
+}
+
+static const StencilKernels AVX512Kernels = {"avx512", jacobiAVX512, residualNormAVX512};
+
+#endif
+
+const StencilKernels *SelectStencilKernels(const std::string &name)
+{
+#if STENCIL_X86
+    __builtin_cpu_init();
+    bool hasAVX512 = __builtin_cpu_supports("avx512f");
+    bool hasAVX2 = __builtin_cpu_supports("avx2");
+    bool hasSSE2 = __builtin_cpu_supports("sse2");
+
+    if (name == "auto")
+    {
+        if (hasAVX512) return &AVX512Kernels;
+        if (hasAVX2) return &AVX2Kernels;
+        if (hasSSE2) return &SSE2Kernels;
+        return &ScalarKernels;
+    }
+    if (name == "avx512") return hasAVX512 ? &AVX512Kernels : nullptr;
+    if (name == "avx2") return hasAVX2 ? &AVX2Kernels : nullptr;
+    if (name == "sse2") return hasSSE2 ? &SSE2Kernels : nullptr;
+#else
+    if (name == "auto") return &ScalarKernels;
+#endif
+    if (name == "scalar") return &ScalarKernels;
+    return nullptr;
+}
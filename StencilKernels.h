@@ -0,0 +1,33 @@
+#ifndef StencilKernels_H
+#define StencilKernels_H
+
+// Hand vectorized 5-point stencil kernels for the fine levels.
+// The kernels work on the columns [j0, j1) of a column-major M x N array, the Jacobi sweep
+// on the rows [i0, i1) and the residual norm on all the interior rows 1..M-2, and use the same
+// order of operations in every version so the result does not depend on the instruction set
+// (no fused multiply-add).
+//
+// The implementation is chosen at startup from what the CPU supports:
+//   const StencilKernels *k = SelectStencilKernels("auto");
+//   k->jacobi(u, unew, f, M, 1, 1, M-1, 1, N-1, h*h, omega);
+
+#include <string>
+
+struct StencilKernels
+{
+    const char *name;
+
+    // unew = (1-omega)*u + omega*(u(i-1,j)+u(i+1,j)+u(i,j-1)+u(i,j+1) - h2*f)/4
+    // The neighbours u(i-1,j) and u(i+1,j) are s entries away, 1 for a plain array and K for
+    // K systems interleaved per grid point (M is then the column length M*K).
+    void (*jacobi)(const double *u, double *unew, const double *f, int M, int s, int i0, int i1, int j0, int j1, double h2, double omega);
+
+    // max |f - (u(i-1,j)+u(i+1,j)+u(i,j-1)+u(i,j+1) - 4u)/h^2| over the columns [j0, j1)
+    double (*residualNorm)(const double *u, const double *f, int M, int j0, int j1, double invh2);
+};
+
+// name is "auto" for the widest instruction set this CPU supports, or one of
+// "scalar", "sse2", "avx2", "avx512".  Returns nullptr if the CPU can not run it.
+extern const StencilKernels *SelectStencilKernels(const std::string &name);
+
+#endif
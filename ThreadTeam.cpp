@@ -0,0 +1,105 @@
+#include "ThreadTeam.h"
+
+// Number of polls before a waiting thread starts to yield, and then to sleep.
+static const int SpinCount = 2000;
+static const int YieldCount = 200;
+
+ThreadTeam::ThreadTeam(int howManyThreads)
+: size(howManyThreads < 1 ? 1 : howManyThreads), job(nullptr), generation(0), finished(0), stopping(false),
+  barrierCount(0), barrierPhase(0), sleepers(0)
+{
+    for(int t = 1; t < size; t++)
+        workers.push_back(std::thread(&ThreadTeam::WorkerLoop, this, t));
+}
+
+ThreadTeam::~ThreadTeam()
+{
+    stopping = true;
+    {
+        std::lock_guard<std::mutex> lock(sleepLock);
+        generation.fetch_add(1);
+    }
+    wakeUp.notify_all();
+    for(size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+void ThreadTeam::Run(const std::function<void(int)> &kernel)
+{
+    if (size == 1)
+    {
+        kernel(0);
+        return;
+    }
+
+    job = &kernel;
+    finished.store(0, std::memory_order_relaxed);
+    generation.fetch_add(1);
+    if (sleepers.load() > 0)
+    {
+        // Taking the lock makes sure a worker that is about to sleep sees the new job.
+        std::lock_guard<std::mutex> lock(sleepLock);
+        wakeUp.notify_all();
+    }
+
+    kernel(0);
+
+    int polls = 0;
+    while (finished.load(std::memory_order_acquire) != size - 1)
+    {
+        if (++polls > SpinCount) std::this_thread::yield();
+    }
+    job = nullptr;
+}
+
+void ThreadTeam::Barrier(void)
+{
+    if (size == 1) return;
+
+    unsigned int phase = barrierPhase.load(std::memory_order_acquire);
+    if (barrierCount.fetch_add(1, std::memory_order_acq_rel) == size - 1)
+    {
+        // Last one in releases the others.
+        barrierCount.store(0, std::memory_order_relaxed);
+        barrierPhase.fetch_add(1, std::memory_order_release);
+        return;
+    }
+    int polls = 0;
+    while (barrierPhase.load(std::memory_order_acquire) == phase)
+    {
+        if (++polls > SpinCount) std::this_thread::yield();
+    }
+}
+
+void ThreadTeam::WaitForJob(unsigned int seen)
+{
+    int polls = 0;
+    while (generation.load(std::memory_order_acquire) == seen)
+    {
+        if (++polls <= SpinCount) continue;
+        if (polls <= SpinCount + YieldCount)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        sleepers.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(sleepLock);
+            wakeUp.wait(lock, [&] {return generation.load() != seen;});
+        }
+        sleepers.fetch_sub(1);
+    }
+}
+
+void ThreadTeam::WorkerLoop(int t)
+{
+    unsigned int seen = 0;
+    while (true)
+    {
+        WaitForJob(seen);
+        seen = generation.load(std::memory_order_acquire);
+        if (stopping) return;
+        (*job)(t);
+        finished.fetch_add(1, std::memory_order_release);
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef ThreadTeam_H
+#define ThreadTeam_H
+
+// A team of worker threads that is created once and reused for every parallel
+// phase of a solve, instead of creating threads for each kernel call.
+//
+// Use:
+//   ThreadTeam team(8);
+//   team.Run([&](int t) {
+//       ... part t of 8 ...
+//       team.Barrier();   // wait for all members before the next phase
+//       ...
+//   });
+//
+// The calling thread is member 0 and the workers are members 1..Size()-1.
+// Run() returns when every member has finished its part.  Between calls the
+// workers spin for a short while, then yield, and finally sleep, so an idle
+// team does not take CPU time away from the serial parts of the program.
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadTeam
+{
+public:
+    explicit ThreadTeam(int howManyThreads);
+    ~ThreadTeam();
+
+    int Size(void) const {return size;}
+
+    void Run(const std::function<void(int)> &kernel);
+
+    // Only valid inside Run(), and has to be called by all the members.
+    void Barrier(void);
+
+private:
+    ThreadTeam(const ThreadTeam &);
+    ThreadTeam &operator=(const ThreadTeam &);
+
+    void WorkerLoop(int t);
+    void WaitForJob(unsigned int seen);
+
+    int size;
+    std::vector<std::thread> workers;
+
+    const std::function<void(int)> *job;
+    std::atomic<unsigned int> generation;   // incremented for every job
+    std::atomic<int> finished;              // workers done with the current job
+    bool stopping;
+
+    std::atomic<int> barrierCount;
+    std::atomic<unsigned int> barrierPhase;
+
+    std::atomic<int> sleepers;
+    std::mutex sleepLock;
+    std::condition_variable wakeUp;
+};
+
+#endif
@@ -18,25 +18,235 @@
 #include <Eigen/Sparse>
 #include <Eigen/Core>
 #include <vector>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <boost/program_options.hpp>
 
+#include "ThreadTeam.h"
+#include "StencilKernels.h"
+#include "FastPoisson.h"
+
 namespace po = boost::program_options;
 
 typedef Eigen::SparseMatrix<double> SpMat; // declares a column-major sparse matrix type of double
 typedef Eigen::Triplet<double> T;
 
 
+// The variable coefficient operator div(a grad u) of a level as a 5-point stencil.  W(i,j)
+// couples (i-1,j) and (i,j), S(i,j) couples (i,j-1) and (i,j), both already divided by the
+// square of the spacing, and invD(i,j) is one over the sum of the four couplings of (i,j).
+// Px and Py are the weights of the lower neighbour when (i,j) is interpolated from its two
+// neighbours in x or in y.  Each is its own M x N array so the sweeps load all of them with
+// unit stride.  The coarse levels of a masked domain have nine points, see maskedStencil():
+// SW(i,j) couples (i-1,j-1) and (i,j), SE(i,j) couples (i+1,j-1) and (i,j), invD is one over
+// the diagonal and there are no interpolation weights.
+typedef struct stencil
+{
+    DTMutableDoubleArray W;
+    DTMutableDoubleArray S;
+    DTMutableDoubleArray invD;
+    DTMutableDoubleArray Px;
+    DTMutableDoubleArray Py;
+    DTMutableDoubleArray SW;
+    DTMutableDoubleArray SE;
+}stenciltype;
+
+// The operator of a level coarsened from an odd number of intervals differs from the Laplacian
+// on its last interior row and column, see coarseEdges().  On the last row ex is added to the
+// diagonal of the coupling in x, whose boundary neighbour gets the weight 1+ex, and the coupling
+// in y is scaled by mx.  ey and my do the same on the last column.
+typedef struct edges
+{
+    double ex = 0, ey = 0;
+    double mx = 1, my = 1;
+}edgetype;
+
+inline bool hasEdges(const edgetype &e)
+{
+    return e.ex != 0 || e.ey != 0 || e.mx != 1 || e.my != 1;
+}
+
+// The coefficients at the point (i, j) of an M x N level, the Laplacian away from the edges
+inline edgetype edgeAt(const edgetype &e, int M, int N, int i, int j)
+{
+    edgetype at;
+    if (i == M-2)
+    {
+        at.ex = e.ex;
+        at.mx = e.mx;
+    }
+    if (j == N-2)
+    {
+        at.ey = e.ey;
+        at.my = e.my;
+    }
+    return at;
+}
+
+typedef struct BlockingSettings
+{
+    int sweeps;         // Jacobi sweeps done in one pass over a level, 1 turns temporal blocking off
+    int cacheBytes;     // the working set of a tile should fit in this much cache
+}BlockingSettings;
+
+const int MaxBlockedSweeps = 16;
+
+// What the kernels of one solver run with.  Every solver builds its own in Setup() from its
+// MGParameters and copies it into its levels, so solvers used from different threads share
+// nothing.  The column ranges of the kernels are split across the team, see parallelSweeps().
+typedef struct ExecutionSettings
+{
+    ThreadTeam *team;               // owned by the solver and set in its Setup(), nullptr runs everything on the calling thread
+    int minDim;                     // levels with a smaller dimension stay on one thread
+    BlockingSettings blocking;
+    const StencilKernels *kernels;  // vectorized Jacobi and residual kernels
+}ExecutionSettings;
+
 typedef struct grid
 {
     DTMutableMesh2D f;  // rhs
     DTMutableMesh2D v;  // solution
+    DTMutableDoubleArray w; // scratch buffer for Jacobi, same size and boundary values as v
+    stenciltype A;      // empty for the Laplacian
+    DTMask active;      // the points with an equation in a masked domain, empty for the whole interior
+    DTIntArray firstInterval;   // the first interval of active in every column, N+1 entries
+    edgetype edges;     // the Laplacian unless coarsened from an odd number of intervals
+    DTMutableDoubleArray edgeScratch;   // M+N values for the red-black sweeps of the edges, empty without them
+    ExecutionSettings exec;
 }gridtype;
 
+// The DataTank array type for values of type Real
+template <class Real> struct RealArray;
+template <> struct RealArray<double> {typedef DTMutableDoubleArray type;};
+template <> struct RealArray<float> {typedef DTMutableFloatArray type;};
+
+// K systems with the same operator on one grid.  The values are interleaved per grid point,
+// value r at point (i,j) is at r + K*(i + j*M), so every stencil load serves all K systems.
+// With K = 1 and Real = float it holds the single precision levels of the mixed precision mode.
+template <class Real>
+struct batchedgrid
+{
+    DTMesh2DGrid grid;
+    typename RealArray<Real>::type f;  // K x M x N, rhs
+    typename RealArray<Real>::type v;  // K x M x N, solution
+    typename RealArray<Real>::type w;  // scratch buffer for Jacobi, same size and boundary values as v
+    edgetype edges;
+    typename RealArray<Real>::type edgeScratch;    // K x (M+N) for the red-black sweeps of the edges, empty without them
+    ExecutionSettings exec;
+};
+typedef batchedgrid<double> batchedgridtype;
+typedef batchedgrid<float> floatgridtype;
+
+// One level of the 3D problem on cubes of side h, the value at (i,j,k) is at i + j*M + k*M*N.
+typedef struct grid3D
+{
+    double h;
+    DTMutableDoubleArray f;  // M x N x O, rhs
+    DTMutableDoubleArray v;  // M x N x O, solution
+    DTMutableDoubleArray w;  // scratch buffer for Jacobi and the residual, same boundary values as v
+    ExecutionSettings exec;
+}grid3Dtype;
+
+enum BoundaryType
+{
+    DirichletBoundary,  // the values of boundary_func() on the edges of the grid
+    NeumannBoundary,    // zero normal derivative, every point of the grid is an unknown
+    PeriodicBoundary    // the last row and column of the grid repeat the first ones
+};
+
+// One level of a problem with Neumann or periodic boundaries.  The arrays have a halo of one
+// point all around, (M+2) x (N+2), and point (i,j) of the grid is at i+1 + (j+1)*(M+2).  The
+// unknowns are 1..Lx x 1..Ly, the halo and, for periodic boundaries, the repeated last row and
+// column are copies of unknowns, see fillHalo().
+typedef struct halogrid
+{
+    double dx, dy;
+    int Lx, Ly;
+    BoundaryType bc;
+    DTMutableDoubleArray f;
+    DTMutableDoubleArray v;
+    DTMutableDoubleArray w;  // scratch buffer for Jacobi
+    ExecutionSettings exec;
+}halogridtype;
+
+// One level of a cell-centred problem with M x N cells of size dx x dy.  The arrays have a frame
+// of ghost cells, (M+2) x (N+2), and cell (i,j) is at i + j*(M+2) for 1 <= i <= M, 1 <= j <= N.
+// The frame of v holds twice the boundary value on the face it touches, see relax(cellgridtype&).
+typedef struct cellgrid
+{
+    double dx, dy;
+    DTMutableDoubleArray f;  // rhs, the frame is not used
+    DTMutableDoubleArray v;  // solution
+    DTMutableDoubleArray w;  // scratch buffer for Jacobi, same frame as v
+    ExecutionSettings exec;
+}cellgridtype;
+
+enum SmootherType
+{
+    JacobiSmoother,     // weighted Jacobi, omega is the damping weight
+    GaussSeidelSmoother,// red-black Gauss-Seidel, in place
+    SORSmoother,        // red-black SOR, in place, omega is the over-relaxation factor
+    LineSmoother        // zebra line Gauss-Seidel along the direction with the smaller spacing
+};
+
+enum CoarseOperatorType
+{
+    GalerkinOperator,   // R A P, collapsed to 5 points
+    HarmonicAveraging   // harmonic means of the couplings in series, averages of those side by side
+};
+
+enum CycleType
+{
+    VCycle,
+    WCycle,
+    FCycle
+};
+
+typedef struct MGParameters
+{
+    int Nv;                 // number of cycles
+    int Ndown;              // smoothing sweeps before restriction
+    int Nup;                // smoothing sweeps after interpolation
+    double omega;           // Jacobi weight or SOR factor
+    int coarsest;           // threshold dimension to use a direct solver
+    SmootherType smoother;
+    CycleType cycle;
+    bool fmg;               // the first cycle is a full multigrid pass
+    int Nfmg;               // cycles per level in the full multigrid pass
+    double rtol;            // stop when the residual norm is below rtol times the initial one
+    double atol;            // or below atol
+    bool mgcg;              // conjugate gradients preconditioned by one V cycle
+    bool symmetric;         // sweep the colours in reverse order after interpolation, so a cycle is a symmetric operator
+    bool mixed;             // cycles in single precision, residual and solution in double
+    CoarseOperatorType coarseop;    // how the coarse operators of div(a grad u) are built
+    bool fas;               // full approximation scheme for the nonlinear Laplacian(u) - lambda e^u = f
+    double lambda;
+    bool sineCoarse;        // solve the coarsest level with sine transforms instead of Cholesky
+    int threads;            // number of threads used by the stencil kernels
+    int parallelDim;        // levels with a smaller dimension stay on one thread
+    BlockingSettings blocking;
+    const StencilKernels *kernels;  // vectorized Jacobi and residual kernels, see SelectStencilKernels()
+}MGParameters;
+
+// Starts the team of a solver, or keeps the one from an earlier Setup() with the same size,
+// and returns the settings its levels run with.
+ExecutionSettings solverExecution(const MGParameters &params, std::unique_ptr<ThreadTeam> &team)
+{
+    if (!team || team->Size() != params.threads)
+        team.reset(new ThreadTeam(params.threads));
+    ExecutionSettings exec = {team.get(), params.parallelDim, params.blocking, params.kernels};
+    return exec;
+}
+
 typedef struct OutputWrapper
 {
     DTDoubleArray ResidualNorms;
     DTDoubleArray Times;
-    OutputWrapper(DTDoubleArray _res, DTDoubleArray _times) : ResidualNorms(_res), Times(_times) {}
+    DTDoubleArray LevelTimes;   // total time spent on each level, finest first
+    OutputWrapper(DTDoubleArray _res, DTDoubleArray _times, DTDoubleArray _levels) : ResidualNorms(_res), Times(_times), LevelTimes(_levels) {}
 }MGOutputs;
 
 
@@ -46,6 +256,75 @@ double boundary_func(double x, double y)
 //    return 3*x+5*y;
 }
 
+double boundary_func3D(double x, double y, double z)
+{
+    return 0;
+}
+
+// The 5-point stencil -dx^2 * Laplacian on the interior points of an MxN grid, numbered
+// column by column, r = dx^2/dy^2 is the weight of the neighbours in y.  The boundary values
+// have to be moved to the right hand side.  The last interior row and column can have edges,
+// see edgetype.
+SpMat laplacianMatrix(int M, int N, double r = 1.0, const edgetype &edges = edgetype())
+{
+    int ukn = (M-2)*(N-2); // unknowns in total
+    int k = M-2;    // bandwidth for storage
+
+    std::vector<T> coefficients;            // list of non-zeros coefficients
+    for (int i = 0; i < ukn; i++) {
+        coefficients.push_back(T(i,i,2.0+2.0*r));
+        if( i-k >= 0 ) coefficients.push_back(T(i,i-k,-r));
+        if( i+k < ukn ) coefficients.push_back(T(i,i+k,-r));
+        if( ( (i+1)%k != 0 ) && (i+1 < ukn) ) coefficients.push_back(T(i,i+1,-1.0));
+        if( ( i%k != 0 ) && (i-1 >= 0) ) coefficients.push_back(T(i,i-1,-1.0));
+    }
+    if (hasEdges(edges))
+    {
+        // The difference to the Laplacian, added to the coefficients above
+        for (int j = 1; j < N-1; j++) {
+            for (int i = 1; i < M-1; i++) {
+                edgetype at = edgeAt(edges, M, N, i, j);
+                if (!hasEdges(at)) continue;
+                int n = (i-1) + (j-1)*k;
+                coefficients.push_back(T(n, n, (at.my * (2.0 + at.ex) - 2.0) + r * (at.mx * (2.0 + at.ey) - 2.0)));
+                if (i > 1) coefficients.push_back(T(n, n-1, 1.0 - at.my));
+                if (i < M-2) coefficients.push_back(T(n, n+1, 1.0 - at.my));
+                if (j > 1) coefficients.push_back(T(n, n-k, r * (1.0 - at.mx)));
+                if (j < N-2) coefficients.push_back(T(n, n+k, r * (1.0 - at.mx)));
+            }
+        }
+    }
+
+    SpMat A(ukn, ukn);
+    A.setFromTriplets(coefficients.begin(), coefficients.end());
+    return A;
+}
+
+// The matrix of -div(a grad u) on the interior points, numbered as in laplacianMatrix().  The
+// boundary values have to be moved to the right hand side.
+SpMat stencilMatrix(const stenciltype &A)
+{
+    int M = A.W.m();
+    int N = A.W.n();
+    int m = M-2;
+    std::vector<T> coefficients;
+    for(int j = 1; j < N-1; j++)
+    {
+        for(int i = 1; i < M-1; i++)
+        {
+            int row = (i-1) + (j-1)*m;
+            coefficients.push_back(T(row, row, A.W(i, j) + A.W(i+1, j) + A.S(i, j) + A.S(i, j+1)));
+            if (i > 1) coefficients.push_back(T(row, row-1, -A.W(i, j)));
+            if (i < M-2) coefficients.push_back(T(row, row+1, -A.W(i+1, j)));
+            if (j > 1) coefficients.push_back(T(row, row-m, -A.S(i, j)));
+            if (j < N-2) coefficients.push_back(T(row, row+m, -A.S(i, j+1)));
+        }
+    }
+    SpMat S(m*(N-2), m*(N-2));
+    S.setFromTriplets(coefficients.begin(), coefficients.end());
+    return S;
+}
+
 DTMutableDoubleArray getSparseSol(const DTMesh2D& f, double g(double, double))
 {
     DTMesh2DGrid grid = f.Grid();
@@ -77,21 +356,8 @@ DTMutableDoubleArray getSparseSol(const DTMesh2D& f, double g(double, double))
 
     // fill A and b;
     int ukn = (M-2)*(N-2); // unknowns in total
-    int k = M-2;    // bandwidth for storage
-
-    std::vector<T> coefficients;            // list of non-zeros coefficients
     Eigen::VectorXd bvec(ukn);                   // the right hand side-vector resulting from the constraints
-
-    for (int i = 0; i < ukn; i++) {
-        coefficients.push_back(T(i,i,4.0));
-        if( i-k >= 0 ) coefficients.push_back(T(i,i-k,-1.0));
-        if( i+k < ukn ) coefficients.push_back(T(i,i+k,-1.0));
-        if( ( (i+1)%k != 0 ) && (i+1 < ukn) ) coefficients.push_back(T(i,i+1,-1.0));
-        if( ( i%k != 0 ) && (i-1 >= 0) ) coefficients.push_back(T(i,i-1,-1.0));
-    }
-
-    SpMat A(ukn, ukn);
-    A.setFromTriplets(coefficients.begin(), coefficients.end());
+    SpMat A = laplacianMatrix(M, N);
 
     // Fill in right hand side as a 2-D array
     DTMutableDoubleArray b(M-2, N-2);
@@ -129,6 +395,66 @@ DTMutableDoubleArray getSparseSol(const DTMesh2D& f, double g(double, double))
     return toReturn;
 }
 
+// Same as getSparseSol() with the fast sine transform solver, which has no fill-in and takes
+// seconds on the largest grids, and with dy != dx.
+DTMutableDoubleArray getFastSol(const DTMesh2D& f, double g(double, double), ThreadTeam *team = nullptr)
+{
+    DTMesh2DGrid grid = f.Grid();
+    double dx = grid.dx();
+    double dy = grid.dy();
+    DTDoubleArray fData = f.DoubleData();
+
+    int M = fData.m();
+    int N = fData.n();
+
+    // Fill boundary condition
+    DTMutableDoubleArray toReturn(M, N);
+    double xzero = grid.Origin().x;
+    double yzero = grid.Origin().y;
+    double xm = xzero + (M-1)*dx;
+    double yn = yzero + (N-1)*dy;
+    for (int j = 0; j < N; j++) {
+        double y = yzero + j*dy;
+        toReturn(0,j) = g(xzero, y);
+        toReturn(M-1,j) = g(xm, y);
+    }
+    for (int i = 0; i < M; i++) {
+        double x = xzero + i*dx;
+        toReturn(i,0) = g(x, yzero);
+        toReturn(i,N-1) = g(x, yn);
+    }
+    if (M < 3 || N < 3) return toReturn;
+
+    // Right hand side of the system of laplacianMatrix(M, N, r), with the boundary moved over
+    double r = (dx * dx) / (dy * dy);
+    double h2 = dx * dx;
+    DTMutableDoubleArray b(M-2, N-2);
+    for(int j = 0; j < N-2; j++){
+        for(int i = 0; i < M-2; i++){
+            b(i, j) = -h2 * fData(i+1,j+1);
+        }
+    }
+    for(int i = 0; i < M-2; i++){
+        b(i, 0) += r * toReturn(i+1, 0);
+        b(i, N-3) += r * toReturn(i+1, N-1);
+    }
+    for(int j = 0; j < N-2; j++){
+        b(0, j) += toReturn(0, j+1);
+        b(M-3, j) += toReturn(M-1, j+1);
+    }
+
+    FastPoissonSolver fast;
+    fast.Setup(M-2, N-2, r);
+    fast.Solve(b.Pointer(), team);
+
+    for(int j = 1; j < N-1; j++){
+        for(int i = 1; i < M-1; i++){
+            toReturn(i, j) = b(i-1, j-1);
+        }
+    }
+    return toReturn;
+}
+
 void printMatrix(const DTDoubleArray &p)
 {
     printf("Dimension: %dx%d\n", p.m(), p.n());
@@ -150,310 +476,4749 @@ double calcNorm(const DTDoubleArray ref)
 }
 
 
-void direct_solve(gridtype &p)
+// Direct solver for the coarsest level.  The sparse Cholesky factorization is computed once
+// when the hierarchy is set up and every solve is just the two triangular solves.  The
+// Laplacian can use the sine transform solver instead, which has no fill-in, so the coarsest
+// level can be much larger.
+class CoarseSolver
 {
-    auto u = p.v.DoubleData();
-    auto fData = p.f.DoubleData();
-    int N = p.v.n();
-    int M = p.v.m();
-    assert(M == N);
-    assert(M % 2 == 1);
-    double h2 = p.v.Grid().dx() * p.v.Grid().dx();
-    double factor = 0.25;
-    if(M == 3)
+public:
+    CoarseSolver() : M(0), N(0), r(1.0), sineTransform(false) {}
+
+    // r = dx^2/dy^2 on the coarsest level.  The sine transforms only diagonalize the Laplacian
+    // itself, with edges the factorization is used.
+    void Factor(int m, int n, double _r = 1.0, bool _sineTransform = false, const edgetype &_edges = edgetype())
+    {
+        M = m;
+        N = n;
+        r = _r;
+        edges = _edges;
+        A = stenciltype();
+        active = DTMask();
+        sineTransform = _sineTransform && !hasEdges(edges);
+        if (M <= 3 && N <= 3) return;   // single unknown, solved in closed form
+        b.resize((M-2)*(N-2));
+        x.resize((M-2)*(N-2));
+        if (sineTransform)
+        {
+            fast.Setup(M-2, N-2, r);
+            return;
+        }
+        chol.compute(laplacianMatrix(M, N, r, edges));
+        if (chol.info() != Eigen::Success)
+        {
+            printf("Error: Factorization of the %dx%d coarse grid failed!\n", M, N);
+            exit(1);
+        }
+    }
+
+    // For div(a grad u), with the stencil of the coarsest level
+    void Factor(const stenciltype &_A)
+    {
+        M = _A.W.m();
+        N = _A.W.n();
+        r = 1.0;
+        edges = edgetype();
+        A = _A;
+        sineTransform = false;
+        chol.compute(stencilMatrix(A));
+        if (chol.info() != Eigen::Success)
+        {
+            printf("Error: Factorization of the %dx%d coarse grid failed!\n", M, N);
+            exit(1);
+        }
+        b.resize((M-2)*(N-2));
+        x.resize((M-2)*(N-2));
+    }
+
+    // For a masked domain, the unknowns are the active points of the coarsest level.  The
+    // stencil is the one of maskedStencil(), empty when the finest level is the coarsest.
+    void Factor(const DTMask &_active, int m, int n, double _r, const stenciltype &_A = stenciltype())
     {
-        u(1, 1) = (u(0,1)+u(2,1)+u(1,0)+u(1,2)-fData(1,1)*h2) * factor;
-    }else{
-        printf("Error: Direct solver not defined for %dx%d matrices!\n", M, M);
+        M = m;
+        N = n;
+        r = _r;
+        edges = edgetype();
+        A = _A;
+        active = _active;
+        sineTransform = false;
+        number = DTMutableIntArray(M, N);
+        number = -1;
+        const int *intervals = active.Intervals().Pointer();
+        int unknowns = 0;
+        for(int k = 0; k < active.Intervals().n(); k++)
+            for(int o = intervals[2*k]; o <= intervals[2*k+1]; o++)
+                number(o) = unknowns++;
+        b.resize(unknowns);
+        x.resize(unknowns);
+        if (unknowns == 0) return;
+        std::vector<T> coefficients;
+        for(int o = 0; o < M*N; o++)
+        {
+            if (number(o) < 0) continue;
+            if (A.W.NotEmpty())
+            {
+                // The nine points of maskedStencil()
+                const int offset[8] = {-1, 1, -M, M, -1-M, 1+M, 1-M, -1+M};
+                const double coupling[8] = {A.W(o), A.W(o+1), A.S(o), A.S(o+M), A.SW(o), A.SW(o+1+M), A.SE(o), A.SE(o-1+M)};
+                coefficients.push_back(T(number(o), number(o), 1.0 / A.invD(o)));
+                for(int q = 0; q < 8; q++)
+                    if (number(o + offset[q]) >= 0)
+                        coefficients.push_back(T(number(o), number(o + offset[q]), -coupling[q]));
+                continue;
+            }
+            coefficients.push_back(T(number(o), number(o), 2.0 + 2.0*r));
+            if (number(o-1) >= 0) coefficients.push_back(T(number(o), number(o-1), -1.0));
+            if (number(o+1) >= 0) coefficients.push_back(T(number(o), number(o+1), -1.0));
+            if (number(o-M) >= 0) coefficients.push_back(T(number(o), number(o-M), -r));
+            if (number(o+M) >= 0) coefficients.push_back(T(number(o), number(o+M), -r));
+        }
+        SpMat L(unknowns, unknowns);
+        L.setFromTriplets(coefficients.begin(), coefficients.end());
+        chol.compute(L);
+        if (chol.info() != Eigen::Success)
+        {
+            printf("Error: Factorization of the %dx%d coarse grid failed!\n", M, N);
+            exit(1);
+        }
     }
+
+    void Solve(gridtype &p);
+    template <class Real> void Solve(batchedgrid<Real> &p);
+    void SolveNonlinear(gridtype &p, double lambda);
+
+private:
+    int M, N;
+    double r;
+    edgetype edges;
+    stenciltype A;  // empty for the Laplacian
+    DTMask active;  // empty unless the domain is masked
+    DTMutableIntArray number;   // the unknown of each active point, -1 elsewhere
+    bool sineTransform;
+    FastPoissonSolver fast;
+    Eigen::SimplicialCholesky<SpMat> chol;
+    Eigen::VectorXd b, x;
+    Eigen::MatrixXd B, X;   // one column per system in batched mode
 };
 
-void relax(gridtype &p, int Niter, double omega)  // Jacobi iteration
+void CoarseSolver::Solve(gridtype &p)
 {
     auto u = p.v.DoubleData();
     auto fData = p.f.DoubleData();
-    int N = p.v.n();
-    int M = p.v.m();
-    assert(M == N);
-    assert(M % 2 == 1);
-    double nomega = 1 - omega;
+    assert(u.m() == M && u.n() == N);
     double h2 = p.v.Grid().dx() * p.v.Grid().dx();
-    DTMutableDoubleArray u_old;
     double factor = 0.25;
-    auto ptr_new = u.Pointer();
-    for(int iter = 0; iter < Niter; iter++)
+    if (active.NotEmpty())
+    {
+        if (b.size() == 0) return;
+        const double *ptr = u.Pointer();
+        const double *ptr_f = fData.Pointer();
+        // The values of the neighbours without an equation go to the right hand side, they
+        // are 0 on the coarse levels
+        for(int o = 0; o < M*N; o++)
+        {
+            if (number(o) < 0) continue;
+            if (A.W.NotEmpty())
+            {
+                b[number(o)] = -ptr_f[o];
+                continue;
+            }
+            double rhs = -h2 * ptr_f[o];
+            if (number(o-1) < 0) rhs += ptr[o-1];
+            if (number(o+1) < 0) rhs += ptr[o+1];
+            if (number(o-M) < 0) rhs += r * ptr[o-M];
+            if (number(o+M) < 0) rhs += r * ptr[o+M];
+            b[number(o)] = rhs;
+        }
+        x = chol.solve(b);
+        double *out = u.Pointer();
+        for(int o = 0; o < M*N; o++)
+            if (number(o) >= 0)
+                out[o] = x[number(o)];
+        return;
+    }
+    if (!A.W.IsEmpty())
     {
-        u_old = u.Copy();
-        auto ptr = u_old.Pointer();
+        int cnt = 0;
         for(int j = 1; j < N-1; j++)
         {
             for(int i = 1; i < M-1; i++)
             {
-//                u(i + j*M) = u_old(i + j*M) * nomega +
-//                        ((u_old(i-1 + j*M)+u_old(i+1 + j*M)+u_old(i + (j-1)*M)+u_old(i + (j+1)*M)-fData(i + j*M)*h2) * factor) * omega;
-                *(ptr_new + i + j*M) = *(ptr + i + j*M) * nomega +
-                             ((*(ptr + i-1 + j*M) + *(ptr + i+1 + j*M) + *(ptr + i + (j-1)*M) + *(ptr + i + (j+1)*M) - fData(i + j*M)*h2) * factor) * omega;
+                double rhs = -fData(i, j);
+                if (i == 1) rhs += A.W(1, j) * u(0, j);
+                if (i == M-2) rhs += A.W(M-1, j) * u(M-1, j);
+                if (j == 1) rhs += A.S(i, 1) * u(i, 0);
+                if (j == N-2) rhs += A.S(i, N-1) * u(i, N-1);
+                b[cnt++] = rhs;
             }
         }
+        x = chol.solve(b);
+        cnt = 0;
+        for(int j = 1; j < N-1; j++)
+            for(int i = 1; i < M-1; i++)
+                u(i, j) = x[cnt++];
+        return;
     }
-}
-
-void coarsen(const DTDoubleArray &fine, DTMutableDoubleArray &coarse) // restrict
-{
-    int M = coarse.m();
-    int N = coarse.n();
-    assert(M == N);
-    assert(M % 2 == 1);
-
-    double selfw = 1.0 / 4.0;
-    double neighborw = 1.0 / 8.0;
-    double cornerw = 1.0 / 16.0;
-    coarse = 0;
-    for(int i = 1; i < M-1; i++)
+    if(M == 3 && N == 3)
     {
-        for(int j = 1; j < N-1; j++)
+        if (hasEdges(edges))
         {
-            coarse(i, j) = fine(i*2, j*2) * selfw +
-                    (fine(i*2-1, j*2) + fine(i*2+1, j*2) + fine(i*2, j*2-1) + fine(i*2, j*2+1)) * neighborw +
-                    (fine(i*2-1, j*2-1) + fine(i*2+1, j*2-1) + fine(i*2+1, j*2-1) + fine(i*2+1, j*2+1)) * cornerw;
+            const edgetype &e = edges;
+            u(1, 1) = (e.my * (u(0,1) + (1.0+e.ex)*u(2,1)) + r*e.mx * (u(1,0) + (1.0+e.ey)*u(1,2)) - fData(1,1)*h2) /
+                      (e.my * (2.0 + e.ex) + r*e.mx * (2.0 + e.ey));
         }
+        else if (r == 1.0)
+            u(1, 1) = (u(0,1)+u(2,1)+u(1,0)+u(1,2)-fData(1,1)*h2) * factor;
+        else
+            u(1, 1) = (u(0,1)+u(2,1) + r*(u(1,0)+u(1,2)) - fData(1,1)*h2) / (2.0 + 2.0*r);
+        return;
     }
-}
 
-void refine(const DTDoubleArray &coarse, DTMutableDoubleArray &fine)  // interpolate
-{
-    int M = fine.m();
-    int N = fine.n();
-    assert(M == N);
-    assert(M % 2 == 1);
-    fine = 0;
+    // Right hand side, with the Dirichlet values of the boundary moved over
+    int cnt = 0;
     for(int j = 1; j < N-1; j++)
     {
         for(int i = 1; i < M-1; i++)
         {
-            if( i % 2 == 0 && j % 2 == 0)
-            {
-                fine(i,j) = coarse(i/2, j/2);
-            } else if (i % 2 == 0 && j % 2 == 1)
-            {
-                fine(i,j) = 0.5 * ( coarse(i/2, j/2) + coarse(i/2, j/2+1) );
-            } else if (i % 2 == 1 && j % 2 == 0)
-            {
-                fine(i,j) = 0.5 * ( coarse(i/2, j/2) + coarse(i/2+1, j/2) );
-            } else if (i % 2 == 1 && j % 2 == 1)
-            {
-                fine(i,j) = 0.25 * ( coarse(i/2, j/2) + coarse(i/2+1, j/2) + coarse(i/2, j/2+1) + coarse(i/2+1, j/2+1) );
-            }
+            double rhs = -h2 * fData(i, j);
+            edgetype at = edgeAt(edges, M, N, i, j);
+            if (i == 1) rhs += at.my * u(0, j);
+            if (i == M-2) rhs += at.my * (1.0 + at.ex) * u(M-1, j);
+            if (j == 1) rhs += r * at.mx * u(i, 0);
+            if (j == N-2) rhs += r * at.mx * (1.0 + at.ey) * u(i, N-1);
+            b[cnt++] = rhs;
         }
     }
-//    printf("fine grid:\n");
-//    printMatrix(fine);
-//    printf("coarse grid:\n");
-//    printMatrix(coarse);
-}
-
-DTMutableDoubleArray residual(const gridtype &p)
-{
-    auto u = p.v.DoubleData();
-    auto fData = p.f.DoubleData();
-    int N = p.v.n();
-    int M = p.v.m();
-    assert(M == N);
-    assert(M % 2 == 1);
-    double h2 = p.v.Grid().dx() * p.v.Grid().dx();
-
-
-    auto res = DTMutableDoubleArray(M, N);
-    res = 0;
-    double invh2 = 1.0 / h2;
-    auto ptr = u.Pointer();
-    auto ptr_res = res.Pointer();
-    auto ptr_f = fData.Pointer();
+    if (sineTransform)
+    {
+        x = b;
+        fast.Solve(x.data());
+    }
+    else
+        x = chol.solve(b);
+    cnt = 0;
     for(int j = 1; j < N-1; j++)
     {
         for(int i = 1; i < M-1; i++)
         {
-//            res(i, j) = fData(i, j) - ( u(i-1, j) + u(i+1, j) + u(i, j-1) + u(i, j+1) - u(i, j) * 4.0) * invh2;
-            *(ptr_res + i + j*M) = *(ptr_f + i + j*M) - ( *(ptr + i-1 + j*M) + *(ptr + i+1 + j*M) + *(ptr + i + (j-1)*M) + *(ptr + i + (j+1)*M) - *(ptr + i + j*M) * 4.0) * invh2;
+            u(i, j) = x[cnt++];
         }
     }
-    return res;
 }
 
-MGOutputs MultiGrid(gridtype &prob, int Nv, int Ndown, int Nup, double omega, int coarsest, bool pureJacobi = false)
+template <class Real>
+void CoarseSolver::Solve(batchedgrid<Real> &p)
 {
-    // Initialization
-    int depth = int(log2(1.0f * (prob.f.DoubleData().m() - 1) / coarsest) + 0.5f);
-    gridtype* Grids = new gridtype[depth + 1];
-    Grids[0] = prob;
-
-    // Allocate memory just once
-    for(int d = 1; d <= depth; d++)
+    typename RealArray<Real>::type &u = p.v;
+    const typename RealArray<Real>::type &fData = p.f;
+    int K = u.m();
+    assert(u.n() == M && u.o() == N && r == 1.0);
+    double h2 = p.grid.dx() * p.grid.dx();
+    double factor = 0.25;
+    if(M == 3 && N == 3)
     {
-        int newdim = (Grids[d-1].f.DoubleData().m() - 1) / 2 + 1;
-        auto prevGrid = Grids[d-1].f.Grid();
-        DTMutableDoubleArray dData(newdim, newdim);
-        dData = 0;
-        DTMesh2DGrid grid = DTMesh2DGrid(prevGrid.Origin(), prevGrid.dx() * 2.0, prevGrid.dy() * 2.0, dData.m(),dData.n());
-        Grids[d].f = DTMutableMesh2D(grid, dData.Copy());
-        Grids[d].v = DTMutableMesh2D(grid, dData.Copy());
+        for(int r = 0; r < K; r++)
+        {
+            const edgetype &e = edges;
+            if (hasEdges(e))
+                u(r, 1, 1) = (e.my * (u(r,0,1) + (1.0+e.ex)*u(r,2,1)) + e.mx * (u(r,1,0) + (1.0+e.ey)*u(r,1,2)) - fData(r,1,1)*h2) /
+                             (e.my * (2.0 + e.ex) + e.mx * (2.0 + e.ey));
+            else
+                u(r, 1, 1) = (u(r,0,1)+u(r,2,1)+u(r,1,0)+u(r,1,2)-fData(r,1,1)*h2) * factor;
+        }
+        return;
     }
 
-
-    // Do Nv V cycles
-    DTTimer timer;
-    DTMutableDoubleArray resnorm(Nv+1);
-    DTMutableDoubleArray times(Nv+1);
-    resnorm(0) = calcNorm(residual(Grids[0]));
-    times(0) = 0;
-    for(int iter = 0; iter < Nv; iter++)
+    // All the systems share the factorization, one triangular solve with K right hand sides
+    B.resize((M-2)*(N-2), K);
+    int cnt = 0;
+    for(int j = 1; j < N-1; j++)
     {
-        double before = calcNorm(residual(Grids[0]));
-        double lowest = -1;
-        double time_singleV = 0;
-        if (!pureJacobi)
+        for(int i = 1; i < M-1; i++, cnt++)
         {
-            // Sweep down
-            for(int iDown = 0; iDown < depth; iDown++)
-            {
-//                auto before_refine = calcNorm(residual(Grids[iDown]));
-                timer.Start();
-                relax(Grids[iDown], Ndown, omega);  // Jacobi iterations before refinement
-                time_singleV += timer.Stop();
-//                auto after_refine = calcNorm(residual(Grids[iDown]));
-//                printf("level %d:%.20f -> %.20f\n", iDown, before_refine,after_refine);
-                auto res = residual(Grids[iDown]);
-                auto next = Grids[iDown + 1].f.DoubleData();
-                coarsen(res, next);
-            }
-
-            // Apply direct solver to the coarsest grid
-            direct_solve(Grids[depth]);
-            lowest = calcNorm(residual(Grids[depth]));
-
-            // Sweep up
-            for(int iUp = depth-1; iUp >= 0; iUp--)
+            for(int r = 0; r < K; r++)
             {
-                auto prev = Grids[iUp + 1].v.DoubleData();
-                auto cur = Grids[iUp].v.DoubleData();
-                auto refined = DTMutableDoubleArray(cur.m(), cur.n());
-                refine(prev, refined);
-                cur += refined;
-                timer.Start();
-                relax(Grids[iUp], Nup, omega);  // Jacobi iterations after refinement
-                time_singleV += timer.Stop();
-                prev = 0;   // clear previous solution
+                double rhs = -h2 * fData(r, i, j);
+                edgetype at = edgeAt(edges, M, N, i, j);
+                if (i == 1) rhs += at.my * u(r, 0, j);
+                if (i == M-2) rhs += at.my * (1.0 + at.ex) * u(r, M-1, j);
+                if (j == 1) rhs += at.mx * u(r, i, 0);
+                if (j == N-2) rhs += at.mx * (1.0 + at.ey) * u(r, i, N-1);
+                B(cnt, r) = rhs;
             }
-        }else{
-            relax(Grids[0], 1, omega);
         }
-        times(iter+1) = times(iter) + time_singleV;
-        auto after = calcNorm(residual(Grids[0]));
-//        printf("iteration %d: before=%.20f\tafter=%.20f\tlowest=%.9f\n", iter+1, before, after, lowest);
-        resnorm(iter+1) = after;
     }
-    delete[] Grids;
-    return MGOutputs(resnorm, times);
+    if (sineTransform)
+    {
+        X = B;
+        for(int r = 0; r < K; r++)
+            fast.Solve(X.col(r).data());
+    }
+    else
+        X = chol.solve(B);
+    cnt = 0;
+    for(int j = 1; j < N-1; j++)
+    {
+        for(int i = 1; i < M-1; i++, cnt++)
+        {
+            for(int r = 0; r < K; r++)
+                u(r, i, j) = X(cnt, r);
+        }
+    }
 }
 
-
-int main(int argc,const char *argv[])
+// Splits a range of columns across the thread team of exec.  The kernels below all work on a
+// column range [j0, j1) so that every thread touches a contiguous block of memory.
+// Runs kernel(sweep, j0, j1) for sweep = 0..Nsweeps-1, with a barrier between the sweeps.
+// All sweeps are done in a single dispatch to the team.
+void parallelSweeps(const ExecutionSettings &exec, int dim, int first, int last, int Nsweeps, const std::function<void(int, int, int)> &kernel)
 {
-    // Parse program parameters
-    po::options_description desc( "Allowed options" );
-    desc.add_options()
-            ( "help,h", "produce help message" )
-            ( "Nv,v", po::value< int >()->default_value( 100 ), "number of V cycles to sweep")
-            ( "Nbefore,b", po::value< int >()->default_value( 3 ), "number of Jacobi sweeps before refinement" )
-            ( "Nafter,a", po::value< int >()->default_value( 3 ), "number of Jacobi sweeps after refinement" )
-            ( "omega,o", po::value< double >()->default_value( 0.6 ), "relaxation parameter" )
-            ( "coarsest,c", po::value< int >()->default_value( 2 ), "threshold dimension to use a direct solver" );
-
-
-    po::positional_options_description _p;
-    _p.add( "Nv", 1 );
+    ThreadTeam *team = exec.team;
+    if (team == nullptr || team->Size() == 1 || dim < exec.minDim)
+    {
+        for(int sweep = 0; sweep < Nsweeps; sweep++)
+            kernel(sweep, first, last);
+        return;
+    }
+    int howManyThreads = team->Size();
+    team->Run([&](int t) {
+        int len = last - first;
+        int j0 = first + len * t / howManyThreads;
+        int j1 = first + len * (t+1) / howManyThreads;
+        for(int sweep = 0; sweep < Nsweeps; sweep++)
+        {
+            if (sweep > 0) team->Barrier();
+            kernel(sweep, j0, j1);
+        }
+    });
+}
 
-    po::variables_map vm;
-    po::store( po::command_line_parser( argc, argv ).options( desc ).positional( _p ).run(), vm );
+void parallelColumns(const ExecutionSettings &exec, int dim, int first, int last, const std::function<void(int, int)> &kernel)
+{
+    parallelSweeps(exec, dim, first, last, 1, [&](int, int j0, int j1) {kernel(j0, j1);});
+}
 
-    if ( vm.count( "help" ))
+void redBlackSweep(double *ptr, const double *ptr_f, int M, int j0, int j1, double h2, double omega, int colour)
+{
+    // Updates the points with (i+j)%2 == colour, their neighbours all have the other colour.
+    double nomega = 1 - omega;
+    double factor = 0.25;
+    for(int j = j0; j < j1; j++)
     {
-        std::cout << desc << "\n";
-        return 0;
+        for(int i = 2 - (j + colour) % 2; i < M-1; i += 2)
+        {
+            *(ptr + i + j*M) = *(ptr + i + j*M) * nomega +
+                         ((*(ptr + i-1 + j*M) + *(ptr + i+1 + j*M) + *(ptr + i + (j-1)*M) + *(ptr + i + (j+1)*M) - *(ptr_f + i + j*M)*h2) * factor) * omega;
+        }
     }
+}
 
-    int Nv = vm["Nv"].as< int >();
-    int Ndown = vm["Nbefore"].as< int >();
-    int Nup = vm["Nafter"].as< int >();
+// The sweeps for dx != dy, where the neighbours in x and y have the weights cx = 1/dx^2 and
+// cy = 1/dy^2.  The square stencil keeps its own kernels so its rounding does not change.
+void redBlackSweepAnisotropic(double *ptr, const double *ptr_f, int M, int j0, int j1, double cx, double cy, double omega, int colour)
+{
+    double nomega = 1 - omega;
+    double factor = omega / (2*cx + 2*cy);
+    for(int j = j0; j < j1; j++)
+    {
+        for(int i = 2 - (j + colour) % 2; i < M-1; i += 2)
+        {
+            *(ptr + i + j*M) = *(ptr + i + j*M) * nomega +
+                         (cx * (*(ptr + i-1 + j*M) + *(ptr + i+1 + j*M)) + cy * (*(ptr + i + (j-1)*M) + *(ptr + i + (j+1)*M)) - *(ptr_f + i + j*M)) * factor;
+        }
+    }
+}
+
+void jacobiAnisotropic(const double *ptr, double *ptr_new, const double *ptr_f, int M, int j0, int j1, double cx, double cy, double omega)
+{
+    double nomega = 1 - omega;
+    double factor = omega / (2*cx + 2*cy);
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *l = c - M;
+        const double *r = c + M;
+        const double *f = ptr_f + j*M;
+        double *out = ptr_new + j*M;
+        for(int i = 1; i < M-1; i++)
+        {
+            out[i] = c[i] * nomega + (cx * (c[i-1] + c[i+1]) + cy * (l[i] + r[i]) - f[i]) * factor;
+        }
+    }
+}
+
+// The sweeps for div(a grad u), the couplings come from the stencil arrays of the level
+void jacobiVariable(const double *ptr, double *ptr_new, const double *ptr_f, const stenciltype &A, int M, int j0, int j1, double omega)
+{
+    double nomega = 1 - omega;
+    const double *ptr_W = A.W.Pointer();
+    const double *ptr_S = A.S.Pointer();
+    const double *ptr_invD = A.invD.Pointer();
+    for(int j = j0; j < j1; j++)
+    {
+        const double *c = ptr + j*M;
+        const double *W = ptr_W + j*M;
+        const double *S = ptr_S + j*M;
+        const double *invD = ptr_invD + j*M;
+        const double *f = ptr_f + j*M;
+        double *out = ptr_new + j*M;
+        for(int i = 1; i < M-1; i++)
+        {
+            double sum = W[i] * c[i-1] + W[i+1] * c[i+1] + S[i] * c[i-M] + S[i+M] * c[i+M];
+            out[i] = c[i] * nomega + (sum - f[i]) * invD[i] * omega;
+        }
+    }
+}
+
+void redBlackSweepVariable(double *ptr, const double *ptr_f, const stenciltype &A, int M, int j0, int j1, double omega, int colour)
+{
+    double nomega = 1 - omega;
+    const double *ptr_W = A.W.Pointer();
+    const double *ptr_S = A.S.Pointer();
+    const double *ptr_invD = A.invD.Pointer();
+    for(int j = j0; j < j1; j++)
+    {
+        double *c = ptr + j*M;
+        const double *W = ptr_W + j*M;
+        const double *S = ptr_S + j*M;
+        const double *invD = ptr_invD + j*M;
+        const double *f = ptr_f + j*M;
+        for(int i = 2 - (j + colour) % 2; i < M-1; i += 2)
+        {
+            double sum = W[i] * c[i-1] + W[i+1] * c[i+1] + S[i] * c[i-M] + S[i+M] * c[i+M];
+            c[i] = c[i] * nomega + (sum - f[i]) * invD[i] * omega;
+        }
+    }
+}
+
+// Masked domains.  Only the points in the intervals of p.active are updated, a column at a
+// time, every other point keeps its Dirichlet value (or 0 outside of the domain).
+template <class Point>
+inline void forActive(const gridtype &p, int j0, int j1, const Point &point)
+{
+    const int *intervals = p.active.Intervals().Pointer();
+    const int *first = p.firstInterval.Pointer();
+    for(int n = first[j0]; n < first[j1]; n++)
+        for(int k = intervals[2*n]; k <= intervals[2*n+1]; k++)
+            point(k);
+}
+
+// The points with (i+j)%2 == colour only
+template <class Point>
+inline void forActive(const gridtype &p, int j0, int j1, int colour, const Point &point)
+{
+    const int *intervals = p.active.Intervals().Pointer();
+    const int *first = p.firstInterval.Pointer();
+    int M = p.v.m();
+    for(int n = first[j0]; n < first[j1]; n++)
+    {
+        int start = intervals[2*n];
+        int j = start / M;
+        start += (start - j*M + j + colour) % 2;
+        for(int k = start; k <= intervals[2*n+1]; k += 2)
+            point(k);
+    }
+}
+
+// The points with i%2 == colour%2 and j%2 == colour/2 only, a nine point stencil does not
+// couple two of them
+template <class Point>
+inline void forActiveQuarter(const gridtype &p, int j0, int j1, int colour, const Point &point)
+{
+    const int *intervals = p.active.Intervals().Pointer();
+    const int *first = p.firstInterval.Pointer();
+    int M = p.v.m();
+    for(int n = first[j0]; n < first[j1]; n++)
+    {
+        int start = intervals[2*n];
+        int j = start / M;
+        if (j % 2 != colour / 2) continue;
+        start += (start - j*M + colour) % 2;
+        for(int k = start; k <= intervals[2*n+1]; k += 2)
+            point(k);
+    }
+}
+
+// The couplings times the neighbours of the point k of a level with the nine point stencil of
+// maskedStencil()
+inline double maskedSum(const stenciltype &A, const double *u, int M, int k)
+{
+    const double *W = A.W.Pointer() + k;
+    const double *S = A.S.Pointer() + k;
+    const double *SW = A.SW.Pointer() + k;
+    const double *SE = A.SE.Pointer() + k;
+    return W[0] * u[k-1] + W[1] * u[k+1] + S[0] * u[k-M] + S[M] * u[k+M] +
+           SW[0] * u[k-1-M] + SW[M+1] * u[k+1+M] + SE[0] * u[k+1-M] + SE[M-1] * u[k-1+M];
+}
+
+// Levels coarsened from an odd number of intervals, see edgetype.  Only the points of the last
+// interior row and column differ from the Laplacian, the fast kernels sweep them like any other
+// point and these loops then redo them.  sx and sy are the distances to the neighbours in x
+// and y, at the coefficients of the point from edgeAt().
+template <class Real>
+inline Real edgeLaplacian(const Real *u, int sx, int sy, double cx, double cy, const edgetype &at)
+{
+    return Real(cx * at.my) * (u[-sx] + u[sx] - Real(2) * u[0] + Real(at.ex) * (u[sx] - u[0])) +
+           Real(cy * at.mx) * (u[-sy] + u[sy] - Real(2) * u[0] + Real(at.ey) * (u[sy] - u[0]));
+}
+
+inline double edgeDiagonal(double cx, double cy, const edgetype &at)
+{
+    return cx * at.my * (2 + at.ex) + cy * at.mx * (2 + at.ey);
+}
+
+// Calls point(i, j) for the points of the last interior row and column in the columns [j0, j1),
+// the corner once
+template <class Point>
+inline void forEdges(int M, int N, const edgetype &e, int j0, int j1, const Point &point)
+{
+    bool row = (e.ex != 0 || e.mx != 1);
+    bool column = (e.ey != 0 || e.my != 1);
+    if (row)
+        for(int j = std::max(j0, 1); j < std::min(j1, N-1); j++)
+            point(M-2, j);
+    if (column && j0 <= N-2 && N-2 < j1)
+        for(int i = 1; i < M-1; i++)
+            if (i != M-2 || !row)
+                point(i, N-2);
+}
+
+// Redoes the Jacobi update from in to out of the edge points in the columns [j0, j1), for K
+// interleaved systems
+template <class Real>
+void jacobiEdges(const Real *in, Real *out, const Real *ptr_f, int M, int N, int K, double cx, double cy,
+                 const edgetype &e, int j0, int j1, double omega)
+{
+    forEdges(M, N, e, j0, j1, [&](int i, int j) {
+        edgetype at = edgeAt(e, M, N, i, j);
+        Real factor = omega / edgeDiagonal(cx, cy, at);
+        for(int r = 0; r < K; r++)
+        {
+            int k = (i + j*M)*K + r;
+            out[k] = in[k] + (edgeLaplacian(in + k, K, M*K, cx, cy, at) - ptr_f[k]) * factor;
+        }
+    });
+}
+
+// Runs sweep(), the red-black sweep of one colour over the columns [j0, j1), and redoes the
+// edge points of that colour.  Their neighbours have the other colour, so the updates are
+// computed before the sweep and stored after it, in updated: K values for the point (M-2, j)
+// of the last row at j*K and for the point (i, N-2) of the last column at (N+i)*K.  The
+// threads sweep different columns, so they use different parts of it.
+template <class Real, class Sweep>
+void redBlackEdges(Real *ptr, const Real *ptr_f, Real *updated, int M, int N, int K, double cx, double cy,
+                   const edgetype &e, int j0, int j1, double omega, int colour, const Sweep &sweep)
+{
+    auto slot = [=](int i, int j) {return ((j != N-2 || i == M-2) ? j : N + i) * K;};
+    forEdges(M, N, e, j0, j1, [&](int i, int j) {
+        if ((i + j) % 2 != colour) return;
+        edgetype at = edgeAt(e, M, N, i, j);
+        Real factor = omega / edgeDiagonal(cx, cy, at);
+        Real *out = updated + slot(i, j);
+        for(int r = 0; r < K; r++)
+        {
+            int k = (i + j*M)*K + r;
+            out[r] = ptr[k] + (edgeLaplacian(ptr + k, K, M*K, cx, cy, at) - ptr_f[k]) * factor;
+        }
+    });
+    sweep();
+    forEdges(M, N, e, j0, j1, [&](int i, int j) {
+        if ((i + j) % 2 != colour) return;
+        const Real *in = updated + slot(i, j);
+        for(int r = 0; r < K; r++)
+            ptr[(i + j*M)*K + r] = in[r];
+    });
+}
+
+void relaxRedBlack(gridtype &p, int Niter, double omega, int firstColour)  // Gauss-Seidel/SOR iteration
+{
+    auto u = p.v.DoubleData();
+    auto fData = p.f.DoubleData();
+    int N = p.v.n();
+    int M = p.v.m();
+    double dx = p.v.Grid().dx();
+    double dy = p.v.Grid().dy();
+    double h2 = dx * dx;
+
+    double *ptr = u.Pointer();
+    const double *ptr_f = fData.Pointer();
+    if (p.active.NotEmpty() && !p.A.W.IsEmpty())
+    {
+        // A coarse level of a masked domain, in four colours for the nine points of
+        // maskedStencil().  The reverse order visits them backwards.
+        const stenciltype &A = p.A;
+        const double *invD = A.invD.Pointer();
+        parallelSweeps(p.exec, M, 1, N-1, 4 * Niter, [&](int sweep, int j0, int j1) {
+            int colour = (firstColour == 0) ? sweep % 4 : 3 - sweep % 4;
+            forActiveQuarter(p, j0, j1, colour, [&](int k) {
+                ptr[k] = ptr[k] * (1 - omega) + (maskedSum(A, ptr, M, k) - ptr_f[k]) * invD[k] * omega;
+            });
+        });
+        return;
+    }
+    if (p.active.NotEmpty())
+    {
+        double cx = 1.0 / (dx * dx);
+        double cy = 1.0 / (dy * dy);
+        double factor = omega / (2*cx + 2*cy);
+        parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [&](int sweep, int j0, int j1) {
+            forActive(p, j0, j1, (sweep + firstColour) % 2, [=](int k) {
+                ptr[k] = ptr[k] * (1 - omega) + (cx * (ptr[k-1] + ptr[k+1]) + cy * (ptr[k-M] + ptr[k+M]) - ptr_f[k]) * factor;
+            });
+        });
+        return;
+    }
+    if (!p.A.W.IsEmpty())
+    {
+        const stenciltype &A = p.A;
+        parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [=, &A](int sweep, int j0, int j1) {
+            redBlackSweepVariable(ptr, ptr_f, A, M, j0, j1, omega, (sweep + firstColour) % 2);
+        });
+        return;
+    }
+    double cx = 1.0 / (dx * dx);
+    double cy = 1.0 / (dy * dy);
+    if (hasEdges(p.edges))
+    {
+        edgetype edges = p.edges;
+        double *updated = p.edgeScratch.Pointer();
+        parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [=](int sweep, int j0, int j1) {
+            int colour = (sweep + firstColour) % 2;
+            redBlackEdges(ptr, ptr_f, updated, M, N, 1, cx, cy, edges, j0, j1, omega, colour, [=]() {
+                if (dx != dy)
+                    redBlackSweepAnisotropic(ptr, ptr_f, M, j0, j1, cx, cy, omega, colour);
+                else
+                    redBlackSweep(ptr, ptr_f, M, j0, j1, h2, omega, colour);
+            });
+        });
+        return;
+    }
+    if (dx != dy)
+    {
+        parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [=](int sweep, int j0, int j1) {
+            redBlackSweepAnisotropic(ptr, ptr_f, M, j0, j1, cx, cy, omega, (sweep + firstColour) % 2);
+        });
+        return;
+    }
+    parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [=](int sweep, int j0, int j1) {
+        redBlackSweep(ptr, ptr_f, M, j0, j1, h2, omega, (sweep + firstColour) % 2);
+    });
+}
+
+// Temporally blocked Jacobi sweeps.  Sweep s reads buffer s%2 and writes the other one, so
+// with only two buffers sweep s can not overwrite a point of sweep s-2 until sweep s-1 is done
+// with all of its neighbours.  Skewing the column of sweep s by 2 per sweep (a wavefront in j)
+// and the rows by 1 per sweep (a parallelogram strip in i) satisfies that, so several sweeps
+// are applied to a strip of a few columns while it is in cache.  Every point sees exactly the
+// same inputs as in the plain sweeps, so the result is bitwise identical.
+//
+// L[s] and R[s] are the columns [L[s], R[s]) that sweep s updates in this call.
+void jacobiWavefront(const ExecutionSettings &exec, double *const buffer[2], const double *ptr_f, int M, double h2, double omega,
+                     int Nsweeps, const int *L, const int *R)
+{
+    int rows = exec.blocking.cacheBytes / int(3 * sizeof(double) * (2 * Nsweeps + 1));
+    rows = std::max(rows, 16);
+    int pStart = L[0], pEnd = R[0];
+    for(int s = 1; s < Nsweeps; s++)
+    {
+        pStart = std::min(pStart, L[s] + 2*s);
+        pEnd = std::max(pEnd, R[s] + 2*s);
+    }
+    for(int lo = 1; lo - (Nsweeps - 1) < M-1; lo += rows)
+    {
+        for(int p = pStart; p < pEnd; p++)
+        {
+            for(int s = 0; s < Nsweeps; s++)
+            {
+                int j = p - 2*s;
+                int i0 = std::max(1, lo - s);
+                int i1 = std::min(M-1, lo + rows - s);
+                if (j < L[s] || j >= R[s] || i0 >= i1) continue;
+                exec.kernels->jacobi(buffer[s % 2], buffer[(s + 1) % 2], ptr_f, M, 1, i0, i1, j, j+1, h2, omega);
+            }
+        }
+    }
+}
+
+// Nsweeps Jacobi sweeps starting from buffer[0].  The columns are split between the threads,
+// each thread first does the trapezoid inside its own columns that does not depend on its
+// neighbours, and after a barrier fills in the triangle to the right of its columns.
+void blockedJacobi(const ExecutionSettings &exec, double *const buffer[2], const double *ptr_f, int M, int N, double h2, double omega, int Nsweeps)
+{
+    ThreadTeam *team = exec.team;
+    int howManyThreads = 1;
+    if (team != nullptr && M >= exec.minDim)
+        howManyThreads = std::min(team->Size(), (N - 2) / (4 * Nsweeps));
+    if (howManyThreads <= 1)
+    {
+        int L[MaxBlockedSweeps], R[MaxBlockedSweeps];
+        std::fill(L, L + Nsweeps, 1);
+        std::fill(R, R + Nsweeps, N-1);
+        jacobiWavefront(exec, buffer, ptr_f, M, h2, omega, Nsweeps, L, R);
+        return;
+    }
+
+    int len = N - 2;
+    team->Run([&](int t) {
+        if (t >= howManyThreads)
+        {
+            team->Barrier();
+            return;
+        }
+        int first = 1 + len * t / howManyThreads;
+        int last = 1 + len * (t+1) / howManyThreads;
+        int L[MaxBlockedSweeps], R[MaxBlockedSweeps];
+        for(int s = 0; s < Nsweeps; s++)
+        {
+            L[s] = (t == 0) ? first : first + 2*s;
+            R[s] = (t == howManyThreads - 1) ? last : last - 2*s;
+        }
+        jacobiWavefront(exec, buffer, ptr_f, M, h2, omega, Nsweeps, L, R);
+        team->Barrier();
+        if (t == howManyThreads - 1) return;
+        for(int s = 0; s < Nsweeps; s++)
+        {
+            L[s] = last - 2*s;
+            R[s] = last + 2*s;
+        }
+        jacobiWavefront(exec, buffer, ptr_f, M, h2, omega, Nsweeps, L, R);
+    });
+}
+
+void relaxJacobi(gridtype &p, int Niter, double omega)  // Jacobi iteration
+{
+    auto u = p.v.DoubleData();
+    auto fData = p.f.DoubleData();
+    int N = p.v.n();
+    int M = p.v.m();
+    assert(p.w.m() == M && p.w.n() == N);
+    double dx = p.v.Grid().dx();
+    double dy = p.v.Grid().dy();
+    double h2 = dx * dx;
+
+    // Ping-pong between v and the scratch buffer, no allocation or copy per sweep.
+    double *ptr = u.Pointer();
+    double *ptr_new = p.w.Pointer();
+    const double *ptr_f = fData.Pointer();
+    const StencilKernels *kernels = p.exec.kernels;
+    const BlockingSettings &blocking = p.exec.blocking;
+    if (p.active.NotEmpty() && !p.A.W.IsEmpty())
+    {
+        // A coarse level of a masked domain, see maskedStencil()
+        const stenciltype &A = p.A;
+        const double *invD = A.invD.Pointer();
+        parallelSweeps(p.exec, M, 1, N-1, Niter, [&](int iter, int j0, int j1) {
+            const double *in = (iter % 2 == 0) ? ptr : ptr_new;
+            double *out = (iter % 2 == 0) ? ptr_new : ptr;
+            forActive(p, j0, j1, [&](int k) {
+                out[k] = in[k] * (1 - omega) + (maskedSum(A, in, M, k) - ptr_f[k]) * invD[k] * omega;
+            });
+        });
+    }
+    else if (p.active.NotEmpty())
+    {
+        double cx = 1.0 / (dx * dx);
+        double cy = 1.0 / (dy * dy);
+        double factor = omega / (2*cx + 2*cy);
+        parallelSweeps(p.exec, M, 1, N-1, Niter, [&](int iter, int j0, int j1) {
+            const double *in = (iter % 2 == 0) ? ptr : ptr_new;
+            double *out = (iter % 2 == 0) ? ptr_new : ptr;
+            forActive(p, j0, j1, [=](int k) {
+                out[k] = in[k] * (1 - omega) + (cx * (in[k-1] + in[k+1]) + cy * (in[k-M] + in[k+M]) - ptr_f[k]) * factor;
+            });
+        });
+    }
+    else if (!p.A.W.IsEmpty())
+    {
+        const stenciltype &A = p.A;
+        parallelSweeps(p.exec, M, 1, N-1, Niter, [=, &A](int iter, int j0, int j1) {
+            if (iter % 2 == 0)
+                jacobiVariable(ptr, ptr_new, ptr_f, A, M, j0, j1, omega);
+            else
+                jacobiVariable(ptr_new, ptr, ptr_f, A, M, j0, j1, omega);
+        });
+    }
+    else if (hasEdges(p.edges))
+    {
+        double cx = 1.0 / (dx * dx);
+        double cy = 1.0 / (dy * dy);
+        edgetype edges = p.edges;
+        parallelSweeps(p.exec, M, 1, N-1, Niter, [=](int iter, int j0, int j1) {
+            const double *in = (iter % 2 == 0) ? ptr : ptr_new;
+            double *out = (iter % 2 == 0) ? ptr_new : ptr;
+            if (dx != dy)
+                jacobiAnisotropic(in, out, ptr_f, M, j0, j1, cx, cy, omega);
+            else
+                kernels->jacobi(in, out, ptr_f, M, 1, 1, M-1, j0, j1, h2, omega);
+            jacobiEdges(in, out, ptr_f, M, N, 1, cx, cy, edges, j0, j1, omega);
+        });
+    }
+    else if (dx != dy)
+    {
+        double cx = 1.0 / (dx * dx);
+        double cy = 1.0 / (dy * dy);
+        parallelSweeps(p.exec, M, 1, N-1, Niter, [=](int iter, int j0, int j1) {
+            if (iter % 2 == 0)
+                jacobiAnisotropic(ptr, ptr_new, ptr_f, M, j0, j1, cx, cy, omega);
+            else
+                jacobiAnisotropic(ptr_new, ptr, ptr_f, M, j0, j1, cx, cy, omega);
+        });
+    }
+    else if (blocking.sweeps > 1 && 3 * sizeof(double) * M * N > size_t(blocking.cacheBytes))
+    {
+        // Cache blocked, in groups of blocking.sweeps sweeps
+        for(int iter = 0; iter < Niter; iter += blocking.sweeps)
+        {
+            double *buffer[2] = {ptr, ptr_new};
+            if (iter % 2 == 1) std::swap(buffer[0], buffer[1]);
+            blockedJacobi(p.exec, buffer, ptr_f, M, N, h2, omega, std::min(blocking.sweeps, Niter - iter));
+        }
+    }
+    else
+    {
+        parallelSweeps(p.exec, M, 1, N-1, Niter, [=](int iter, int j0, int j1) {
+            if (iter % 2 == 0)
+                kernels->jacobi(ptr, ptr_new, ptr_f, M, 1, 1, M-1, j0, j1, h2, omega);
+            else
+                kernels->jacobi(ptr_new, ptr, ptr_f, M, 1, 1, M-1, j0, j1, h2, omega);
+        });
+    }
+    if (Niter % 2 == 1)
+    {
+        // The latest iterate lives in the scratch buffer, swap the roles of the two arrays.
+        DTMutableDoubleArray latest = p.w;
+        p.w = u;
+        p.v = DTMutableMesh2D(p.v.Grid(), latest);
+    }
+}
+
+// Zebra line Gauss-Seidel: the lines of one colour are solved exactly with the lines of the
+// other colour fixed, so the coupling along a line can be arbitrarily strong.  The lines run
+// along the direction with the smaller spacing.  The matrix of every line is the same constant
+// tridiagonal one, its elimination factors are computed once, and the Thomas algorithm keeps the
+// eliminated right hand side in the scratch buffer, whose boundary already holds the values the
+// recursion starts from.
+void relaxLines(gridtype &p, int Niter, int firstColour)
+{
+    assert(p.A.W.IsEmpty() && !hasEdges(p.edges));
+    auto u = p.v.DoubleData();
+    auto fData = p.f.DoubleData();
+    int N = p.v.n();
+    int M = p.v.m();
+    double dx = p.v.Grid().dx();
+    double dy = p.v.Grid().dy();
+    bool alongX = (dx <= dy);
+    double a = alongX ? 1.0 / (dx * dx) : 1.0 / (dy * dy);  // coupling along a line
+    double b = alongX ? 1.0 / (dy * dy) : 1.0 / (dx * dx);  // coupling to the neighbouring lines
+    int L = alongX ? M : N;
+
+    std::vector<double> scale(L), upper(L);
+    upper[0] = 0;
+    for(int i = 1; i < L-1; i++)
+    {
+        scale[i] = 1.0 / (2.0 * a + 2.0 * b + a * upper[i-1]);
+        upper[i] = -a * scale[i];
+    }
+    const double *ptr_scale = scale.data();
+    const double *ptr_upper = upper.data();
+
+    double *ptr = u.Pointer();
+    double *ptr_d = p.w.Pointer();
+    const double *ptr_f = fData.Pointer();
+    if (alongX)
+    {
+        // Column j is a line, the threads take ranges of columns.  The recursion along a column
+        // is serial, so a few columns are eliminated side by side to overlap their latencies.
+        const int G = 4;
+        parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [=](int sweep, int j0, int j1) {
+            int colour = (sweep + firstColour) % 2;
+            for(int jg = j0 + (j0 + colour) % 2; jg < j1; jg += 2*G)
+            {
+                int lines = std::min(G, (j1 - jg + 1) / 2);
+                for(int i = 1; i < M-1; i++)
+                {
+                    for(int l = 0; l < lines; l++)
+                    {
+                        int k = i + (jg + 2*l)*M;
+                        ptr_d[k] = (b * (ptr[k-M] + ptr[k+M]) - ptr_f[k] + a * ptr_d[k-1]) * ptr_scale[i];
+                    }
+                }
+                for(int i = M-2; i > 0; i--)
+                {
+                    for(int l = 0; l < lines; l++)
+                    {
+                        int k = i + (jg + 2*l)*M;
+                        ptr[k] = ptr_d[k] - ptr_upper[i] * ptr[k+1];
+                    }
+                }
+            }
+        });
+    }
+    else
+    {
+        // Row i is a line, the threads take ranges of rows and eliminate them together
+        parallelSweeps(p.exec, N, 1, M-1, 2 * Niter, [=](int sweep, int i0, int i1) {
+            int colour = (sweep + firstColour) % 2;
+            int first = i0 + (i0 + colour) % 2;
+            for(int j = 1; j < N-1; j++)
+            {
+                double *x = ptr + j*M;
+                double *d = ptr_d + j*M;
+                const double *f = ptr_f + j*M;
+                for(int i = first; i < i1; i += 2)
+                    d[i] = (b * (x[i-1] + x[i+1]) - f[i] + a * d[i-M]) * ptr_scale[j];
+            }
+            for(int j = N-2; j > 0; j--)
+            {
+                double *x = ptr + j*M;
+                const double *d = ptr_d + j*M;
+                for(int i = first; i < i1; i += 2)
+                    x[i] = d[i] - ptr_upper[j] * x[i+M];
+            }
+        });
+    }
+}
+
+// With reverse set the red-black smoothers update the black points first, which is the adjoint
+// of the usual red-black sweep.  Jacobi is symmetric already.
+void relax(gridtype &p, int Niter, double omega, SmootherType smoother, bool reverse = false)
+{
+    switch(smoother)
+    {
+        case JacobiSmoother:
+            relaxJacobi(p, Niter, omega);
+            break;
+        case GaussSeidelSmoother:
+            relaxRedBlack(p, Niter, 1.0, reverse ? 1 : 0);
+            break;
+        case SORSmoother:
+            relaxRedBlack(p, Niter, omega, reverse ? 1 : 0);
+            break;
+        case LineSmoother:
+            relaxLines(p, Niter, reverse ? 1 : 0);
+            break;
+    }
+}
+
+// 2 in a direction that is coarsened from the fine to the coarse level and 1 in one that is not
+inline int coarseningRatio(int fineDim, int coarseDim)
+{
+    return (fineDim == coarseDim) ? 1 : 2;
+}
+
+// The size of a coarsened direction.  Fine point 2I is coarse point I, and an odd number of
+// intervals is halved rounding up, so the last coarse cell is only one fine spacing wide and
+// its far side is the fine boundary.  The transfers never touch that fine boundary line: its
+// residual counts as 0 and nothing is interpolated to it.
+inline int coarseDim(int fineDim)
+{
+    return fineDim / 2 + 1;
+}
+
+// The operator of such a level is the Galerkin operator (restriction * fine operator *
+// interpolation) of one direction, with the restriction * interpolation of the other direction
+// lumped onto the diagonal, like the Laplacian of a uniform coarse grid is.  In one direction
+// that leaves e on the diagonal of the last interior point and its weight m for the coupling
+// in the other direction, see edgetype.  Both follow from e and m of the finer level.
+inline void coarseEdge(double &e, double &m, int fineDim, int coarseDim)
+{
+    if (fineDim == coarseDim) return;
+    if ((fineDim - 1) % 2 == 1)
+    {
+        // The last interior fine point is the last interior coarse point
+        e = 1.0 + 2.0 * e;
+        m = 0.25 + 0.5 * m;
+    }
+    else
+    {
+        // The last interior fine point lies between the last coarse point and the boundary,
+        // and is interpolated with the weight of interpolateEdges()
+        e = e / (2.0 + e);
+        m = 0.75 + 0.25 * m;
+    }
+}
+
+inline edgetype coarseEdges(const edgetype &fine, const DTMesh2DGrid &fineGrid, const DTMesh2DGrid &coarseGrid)
+{
+    edgetype coarse = fine;
+    coarseEdge(coarse.ex, coarse.mx, fineGrid.m(), coarseGrid.m());
+    coarseEdge(coarse.ey, coarse.my, fineGrid.n(), coarseGrid.n());
+    return coarse;
+}
+
+// Full weighting when only one direction is coarsened, the (1/4)[1 2 1] weights are applied
+// along that direction only.  value(i, j) is the fine grid quantity that is restricted, on
+// the M x N fine level.
+template <class Real, class Value>
+void restrictSemi(const Value &value, Real *ptr_c, int M, int N, int Mc, int ci, int J0, int J1)
+{
+    const Real half = 0.5;
+    const Real quarter = 0.25;
+    for(int J = J0; J < J1; J++)
+    {
+        for(int I = 1; I < Mc-1; I++)
+        {
+            if (ci == 2)
+            {
+                Real outer = (2*I+1 < M-1) ? value(2*I+1, J) : Real(0);
+                *(ptr_c + I + J*Mc) = quarter * value(2*I-1, J) + half * value(2*I, J) + quarter * outer;
+            }
+            else
+            {
+                Real outer = (2*J+1 < N-1) ? value(I, 2*J+1) : Real(0);
+                *(ptr_c + I + J*Mc) = quarter * value(I, 2*J-1) + half * value(I, 2*J) + quarter * outer;
+            }
+        }
+    }
+}
+
+void coarsen(const ExecutionSettings &exec, const DTDoubleArray &fine, DTMutableDoubleArray &coarse) // restrict
+{
+    int M = coarse.m();
+    int N = coarse.n();
+    int ci = coarseningRatio(fine.m(), M);
+    int cj = coarseningRatio(fine.n(), N);
+    if (ci != 2 || cj != 2)
+    {
+        coarse = 0;
+        double *ptr_c = coarse.Pointer();
+        parallelColumns(exec, M, 1, N-1, [&](int J0, int J1) {
+            restrictSemi([&](int i, int j) {return fine(i, j);}, ptr_c, fine.m(), fine.n(), M, ci, J0, J1);
+        });
+        return;
+    }
+
+    double selfw = 1.0 / 4.0;
+    double neighborw = 1.0 / 8.0;
+    double cornerw = 1.0 / 16.0;
+    // The last fine row or column can be the boundary, see coarseDim(), and counts as 0
+    int Mf = fine.m();
+    int Nf = fine.n();
+    auto value = [&](int i, int j) {return (i == Mf-1 || j == Nf-1) ? 0.0 : fine(i, j);};
+    coarse = 0;
+    parallelColumns(exec, M, 1, N-1, [&](int j0, int j1) {
+        for(int j = j0; j < j1; j++)
+        {
+            for(int i = 1; i < M-1; i++)
+            {
+                coarse(i, j) = value(i*2, j*2) * selfw +
+                        (value(i*2-1, j*2) + value(i*2+1, j*2) + value(i*2, j*2-1) + value(i*2, j*2+1)) * neighborw +
+                        (value(i*2-1, j*2-1) + value(i*2+1, j*2-1) + value(i*2-1, j*2+1) + value(i*2+1, j*2+1)) * cornerw;
+            }
+        }
+    });
+}
+
+template <class Real>
+void addProlongated(const Real *ptr_c, Real *ptr, int M, int N, int Mc, int J0, int J1)
+{
+    // Bilinear interpolation of the coarse columns [J0, J1) added to the interior of the
+    // fine columns 2J and 2J+1, split by parity so there are no branches in the loops.  With
+    // an odd number of intervals the last interior row or column is an even one.
+    const Real half = 0.5;
+    const Real quarter = 0.25;
+    int pairs = (M - 1) / 2;    // the rows 2I and 2I+1 are both interior for 0 < I < pairs
+    for(int J = J0; J < J1; J++)
+    {
+        const Real *c0 = ptr_c + J*Mc;
+        const Real *c1 = c0 + Mc;
+        Real *even = ptr + 2*J*M;
+        Real *odd = even + M;
+        if (J > 0)  // fine column 0 is on the boundary
+        {
+            even[1] += half * (c0[0] + c0[1]);
+            for(int I = 1; I < pairs; I++)
+            {
+                even[2*I] += c0[I];
+                even[2*I+1] += half * (c0[I] + c0[I+1]);
+            }
+            if (M % 2 == 0)
+                even[M-2] += c0[pairs];
+        }
+        if (2*J+1 == N-1)
+            continue;
+        odd[1] += quarter * (c0[0] + c0[1] + c1[0] + c1[1]);
+        for(int I = 1; I < pairs; I++)
+        {
+            odd[2*I] += half * (c0[I] + c1[I]);
+            odd[2*I+1] += quarter * (c0[I] + c0[I+1] + c1[I] + c1[I+1]);
+        }
+        if (M % 2 == 0)
+            odd[M-2] += half * (c0[pairs] + c1[pairs]);
+    }
+}
+
+// Linear interpolation along the one coarsened direction, added to the interior of the fine
+// columns [j0, j1).
+template <class Real>
+void addProlongatedSemi(const Real *ptr_c, Real *ptr, int M, int Mc, int ci, int j0, int j1)
+{
+    const Real half = 0.5;
+    for(int j = j0; j < j1; j++)
+    {
+        Real *out = ptr + j*M;
+        if (ci == 2)
+        {
+            const Real *c = ptr_c + j*Mc;
+            for(int I = 0; I < Mc-1; I++)
+            {
+                if (I > 0) out[2*I] += c[I];
+                if (2*I+1 < M-1) out[2*I+1] += half * (c[I] + c[I+1]);
+            }
+        }
+        else
+        {
+            const Real *c0 = ptr_c + (j/2)*Mc;
+            if (j % 2 == 0)
+            {
+                for(int i = 1; i < M-1; i++)
+                    out[i] += c0[i];
+            }
+            else
+            {
+                const Real *c1 = c0 + Mc;
+                for(int i = 1; i < M-1; i++)
+                    out[i] += half * (c0[i] + c1[i]);
+            }
+        }
+    }
+}
+
+// Adds the operator dependent interpolation of the coarse correction to the fine rows j0..j1-1,
+// see prolongationWeight.  The centres of the coarse cells are interpolated from the values of
+// their four neighbours, which are recomputed from the coarse level rather than stored.
+void addProlongatedVariable(const double *ptr_c, double *ptr, const stenciltype &A, int M, int Mc, int ci, int cj, int j0, int j1)
+{
+    const double *Px = A.Px.Pointer();
+    const double *Py = A.Py.Pointer();
+    auto edge = [=](int i, int j) -> double {
+        int k = i + j*M;
+        const double *c = ptr_c + i/ci + (j/cj)*Mc;
+        if (ci == 2 && i % 2 == 1) return Px[k] * c[0] + (1.0 - Px[k]) * c[1];
+        if (cj == 2 && j % 2 == 1) return Py[k] * c[0] + (1.0 - Py[k]) * c[Mc];
+        return c[0];
+    };
+    for(int j = j0; j < j1; j++)
+    {
+        bool oddRow = (cj == 2 && j % 2 == 1);
+        for(int i = 1; i < M-1; i++)
+        {
+            if (oddRow && ci == 2 && i % 2 == 1)
+                ptr[i + j*M] += (A.W(i, j) * edge(i-1, j) + A.W(i+1, j) * edge(i+1, j) + A.S(i, j) * edge(i, j-1) + A.S(i, j+1) * edge(i, j+1)) * A.invD(i, j);
+            else
+                ptr[i + j*M] += edge(i, j);
+        }
+    }
+}
+
+// A fine level with edges and an even number of intervals has its last interior point between
+// the last coarse point and the boundary.  The linear weight 1/2 there does not fit the edge
+// operator, so that point gets w = 1/(2+e) of the coarse point instead, the weight for which
+// the fine operator applied to the interpolated coarse point is 0 there.  This corrects the
+// points of the last interior row and column that addProlongated() and addProlongatedSemi()
+// interpolated with the linear weights.  K systems are interleaved, as in batchedgrid.
+template <class Real>
+void interpolateEdges(const Real *ptr_c, Real *ptr, int M, int N, int Mc, int ci, int cj, int K, const edgetype &e)
+{
+    double wx = (ci == 2 && M % 2 == 1) ? 1.0 / (2.0 + e.ex) : 0.5;
+    double wy = (cj == 2 && N % 2 == 1) ? 1.0 / (2.0 + e.ey) : 0.5;
+    if (wx == 0.5 && wy == 0.5) return;
+
+    // The coarse point below fine point i and its weight, with the edge weight w and linear
+    auto split = [](int i, int c, int last, double w, int &I, double &edge, double &linear) {
+        I = i / c;
+        if (c == 1 || i % 2 == 0)
+            edge = linear = 1.0;
+        else
+        {
+            linear = 0.5;
+            edge = (i == last) ? w : 0.5;
+        }
+    };
+    auto correct = [&](int i, int j) {
+        int I, J;
+        double ex, lx, ey, ly;
+        split(i, ci, M-2, wx, I, ex, lx);
+        split(j, cj, N-2, wy, J, ey, ly);
+        for(int k = 0; k < K; k++)
+        {
+            const Real *c = ptr_c + k + long(K) * (I + J*Mc);
+            auto tensor = [&](double x, double y) {
+                double value = x * y * c[0];
+                if (lx != 1.0) value += (1.0 - x) * y * c[K];
+                if (ly != 1.0) value += x * (1.0 - y) * c[long(K)*Mc];
+                if (lx != 1.0 && ly != 1.0) value += (1.0 - x) * (1.0 - y) * c[long(K)*(Mc+1)];
+                return value;
+            };
+            ptr[k + long(K) * (i + j*M)] += Real(tensor(ex, ey) - tensor(lx, ly));
+        }
+    };
+    if (wx != 0.5)
+        for(int j = 1; j < N-1; j++)
+            correct(M-2, j);
+    if (wy != 0.5)
+        for(int i = 1; i < ((wx != 0.5) ? M-2 : M-1); i++)
+            correct(i, N-2);
+}
+
+void interpolateCorrection(const DTDoubleArray &coarse, gridtype &p)  // v += interpolated coarse correction
+{
+    auto u = p.v.DoubleData();
+    int M = u.m();
+    int N = u.n();
+    int Mc = coarse.m();
+    int ci = coarseningRatio(M, Mc);
+    int cj = coarseningRatio(N, coarse.n());
+    const double *ptr_c = coarse.Pointer();
+    double *ptr = u.Pointer();
+    if (p.active.NotEmpty())
+    {
+        // Linear interpolation in each coarsened direction, to the active points only
+        parallelColumns(p.exec, M, 1, N-1, [&](int j0, int j1) {
+            forActive(p, j0, j1, [&](int k) {
+                int j = k / M;
+                int i = k - j*M;
+                const double *c = ptr_c + i/ci + (j/cj)*Mc;
+                bool oddi = (ci == 2 && i % 2 == 1);
+                bool oddj = (cj == 2 && j % 2 == 1);
+                double below = oddi ? 0.5 * (c[0] + c[1]) : c[0];
+                double above = oddj ? (oddi ? 0.5 * (c[Mc] + c[Mc+1]) : c[Mc]) : 0.0;
+                ptr[k] += oddj ? 0.5 * (below + above) : below;
+            });
+        });
+        return;
+    }
+    if (!p.A.W.IsEmpty())
+    {
+        parallelColumns(p.exec, M, 1, N-1, [&](int j0, int j1) {
+            addProlongatedVariable(ptr_c, ptr, p.A, M, Mc, ci, cj, j0, j1);
+        });
+        return;
+    }
+    if (ci != 2 || cj != 2)
+    {
+        parallelColumns(p.exec, M, 1, N-1, [=](int j0, int j1) {
+            addProlongatedSemi(ptr_c, ptr, M, Mc, ci, j0, j1);
+        });
+        interpolateEdges(ptr_c, ptr, M, N, Mc, ci, cj, 1, p.edges);
+        return;
+    }
+    parallelColumns(p.exec, M, 0, coarse.n()-1, [=](int J0, int J1) {
+        addProlongated(ptr_c, ptr, M, N, Mc, J0, J1);
+    });
+    interpolateEdges(ptr_c, ptr, M, N, Mc, ci, cj, 1, p.edges);
+}
+
+template <class Real>
+inline Real pointResidual(const Real *ptr, const Real *ptr_f, int M, int i, int j, Real invh2)
+{
+    return *(ptr_f + i + j*M) - ( *(ptr + i-1 + j*M) + *(ptr + i+1 + j*M) + *(ptr + i + (j-1)*M) + *(ptr + i + (j+1)*M) - *(ptr + i + j*M) * Real(4)) * invh2;
+}
+
+// The residual for dx != dy, cx = 1/dx^2 and cy = 1/dy^2
+template <class Real>
+inline Real pointResidual(const Real *ptr, const Real *ptr_f, int M, int i, int j, Real cx, Real cy)
+{
+    const Real *u = ptr + i + j*M;
+    return *(ptr_f + i + j*M) - (cx * (u[-1] + u[1] - Real(2) * u[0]) + cy * (u[-M] + u[M] - Real(2) * u[0]));
+}
+
+// The residual of a level with edges, see edgeLaplacian()
+template <class Real>
+inline Real edgeResidual(const Real *ptr, const Real *ptr_f, int M, int N, int i, int j, double cx, double cy, const edgetype &e)
+{
+    int k = i + j*M;
+    return ptr_f[k] - edgeLaplacian(ptr + k, 1, M, cx, cy, edgeAt(e, M, N, i, j));
+}
+
+// The residual of div(a grad u)
+inline double pointResidual(const double *ptr, const double *ptr_f, const double *ptr_W, const double *ptr_S, int M, int i, int j)
+{
+    int k = i + j*M;
+    const double *u = ptr + k;
+    const double *W = ptr_W + k;
+    const double *S = ptr_S + k;
+    return ptr_f[k] - (W[0] * (u[-1] - u[0]) + W[1] * (u[1] - u[0]) + S[0] * (u[-M] - u[0]) + S[M] * (u[M] - u[0]));
+}
+
+// The residual at the active point k of a masked level, of the Laplacian on the finest level
+// and of maskedStencil() on the coarse ones
+inline double maskedResidual(const gridtype &p, const double *ptr, const double *ptr_f, int k, double cx, double cy)
+{
+    int M = p.v.m();
+    if (p.A.W.IsEmpty())
+    {
+        const double *u = ptr + k;
+        return ptr_f[k] - (cx * (u[-1] + u[1] - 2.0 * u[0]) + cy * (u[-M] + u[M] - 2.0 * u[0]));
+    }
+    return ptr_f[k] - (maskedSum(p.A, ptr, M, k) - ptr[k] / p.A.invD.Pointer()[k]);
+}
+
+// Weight of the coarse point C in the operator dependent interpolation of the fine point
+// (i,j) = (ci*I+a, cj*J+b), |a| and |b| at most 1.  A point between two coarse points is
+// interpolated with the weights of its couplings to the two sides, and the centre of a coarse
+// cell from its four neighbours with the weights of its own row of the stencil.  For a
+// constant coefficient this is bilinear interpolation.
+inline double prolongationWeight(const stenciltype &A, int M, int i, int j, int a, int b)
+{
+    int k = i + j*M;
+    const double *Px = A.Px.Pointer();
+    const double *Py = A.Py.Pointer();
+    if (a == 0 && b == 0) return 1.0;
+    if (b == 0) return (a > 0) ? Px[k] : 1.0 - Px[k];
+    if (a == 0) return (b > 0) ? Py[k] : 1.0 - Py[k];
+    // The neighbours (i-a,j) and (i,j-b) of the centre are the ones that depend on C
+    double wy = (b > 0) ? Py[k-a] : 1.0 - Py[k-a];
+    double wx = (a > 0) ? Px[k-b*M] : 1.0 - Px[k-b*M];
+    double cx = (a > 0) ? A.W(i, j) : A.W(i+1, j);
+    double cy = (b > 0) ? A.S(i, j) : A.S(i, j+1);
+    return (cx * wy + cy * wx) * A.invD(i, j);
+}
+
+// Restriction by the transpose of the operator dependent interpolation, scaled like the full
+// weighting, of value(i, j) onto the interior of the coarse level
+template <class Value>
+void restrictVariable(const ExecutionSettings &exec, const Value &value, const stenciltype &A, double *ptr_c, int M, int Mc, int Nc, int ci, int cj)
+{
+    double scale = 1.0 / (ci * cj);
+    int ra = ci - 1;
+    int rb = cj - 1;
+    parallelColumns(exec, M, 1, Nc-1, [&](int J0, int J1) {
+        for(int J = J0; J < J1; J++)
+        {
+            for(int I = 1; I < Mc-1; I++)
+            {
+                double sum = 0;
+                for(int b = -rb; b <= rb; b++)
+                    for(int a = -ra; a <= ra; a++)
+                        sum += prolongationWeight(A, M, ci*I + a, cj*J + b, a, b) * value(ci*I + a, cj*J + b);
+                *(ptr_c + I + J*Mc) = sum * scale;
+            }
+        }
+    });
+}
+
+// The full weighting stencil is (1/4)[1 2 1] in each direction.  For every coarse column J
+// the fine residual is weighted across the columns 2J-1, 2J, 2J+1 as it is computed, and the
+// row weighting reuses the weighted value of row 2I+1 for the next coarse point.
+// The residual is never stored, the odd fine columns are just computed twice.  Row or column
+// 2I+1 can be the boundary of the M x N fine level, see coarseDim().
+template <class Real, class Residual>
+void restrictResidualColumns(const Residual &res, Real *ptr_c, int M, int N, int Mc, int J0, int J1)
+{
+    const Real half = 0.5;
+    const Real quarter = 0.25;
+    for(int J = J0; J < J1; J++)
+    {
+        int j = 2*J;
+        bool lastColumn = (j+1 == N-1);
+        auto weighted = [&](int i) -> Real {
+            Real sum = quarter * res(i, j-1) + half * res(i, j);
+            return lastColumn ? sum : sum + quarter * res(i, j+1);
+        };
+        Real below = weighted(1);
+        for(int I = 1; I < Mc-1; I++)
+        {
+            int i = 2*I;
+            Real mid = weighted(i);
+            Real above = (i+1 < M-1) ? weighted(i+1) : Real(0);
+            *(ptr_c + I + J*Mc) = quarter * below + half * mid + quarter * above;
+            below = above;
+        }
+    }
+}
+
+// Full weighting of res(i, j) onto the interior of the coarse level, in both or in one direction
+template <class Real, class Residual>
+void restrictLevel(const ExecutionSettings &exec, const Residual &res, Real *ptr_c, int M, int N, int Mc, int Nc, int ci, int cj)
+{
+    parallelColumns(exec, M, 1, Nc-1, [&](int J0, int J1) {
+        if (ci == 2 && cj == 2)
+            restrictResidualColumns(res, ptr_c, M, N, Mc, J0, J1);
+        else
+            restrictSemi(res, ptr_c, M, N, Mc, ci, J0, J1);
+    });
+}
+
+void restrictResidual(const gridtype &p, DTMutableDoubleArray &coarse) // fused residual + full weighting
+{
+    auto u = p.v.DoubleData();
+    auto fData = p.f.DoubleData();
+    int N = p.v.n();
+    int M = p.v.m();
+    int Mc = coarse.m();
+    int Nc = coarse.n();
+    int ci = coarseningRatio(M, Mc);
+    int cj = coarseningRatio(N, Nc);
+    double dx = p.v.Grid().dx();
+    double dy = p.v.Grid().dy();
+    double h2 = dx * dx;
+    double invh2 = 1.0 / h2;
+
+    const double *ptr = u.Pointer();
+    const double *ptr_f = fData.Pointer();
+    double *ptr_c = coarse.Pointer();
+    double cx = 1.0 / (dx * dx);
+    double cy = 1.0 / (dy * dy);
+    if (!p.A.W.IsEmpty())
+    {
+        const double *ptr_W = p.A.W.Pointer();
+        const double *ptr_S = p.A.S.Pointer();
+        restrictVariable(p.exec, [=](int i, int j) {return pointResidual(ptr, ptr_f, ptr_W, ptr_S, M, i, j);}, p.A, ptr_c, M, Mc, Nc, ci, cj);
+    }
+    else if (hasEdges(p.edges))
+    {
+        edgetype edges = p.edges;
+        restrictLevel(p.exec, [=](int i, int j) {
+            if (i == M-2 || j == N-2)
+                return edgeResidual(ptr, ptr_f, M, N, i, j, cx, cy, edges);
+            return pointResidual(ptr, ptr_f, M, i, j, cx, cy);
+        }, ptr_c, M, N, Mc, Nc, ci, cj);
+    }
+    else if (dx == dy)
+        restrictLevel(p.exec, [=](int i, int j) {return pointResidual(ptr, ptr_f, M, i, j, invh2);}, ptr_c, M, N, Mc, Nc, ci, cj);
+    else
+        restrictLevel(p.exec, [=](int i, int j) {return pointResidual(ptr, ptr_f, M, i, j, cx, cy);}, ptr_c, M, N, Mc, Nc, ci, cj);
+}
+
+// Full weighting of the residual of a masked level onto the active points of the coarse level,
+// the residual is 0 at the points without an equation.  That is the transpose of the masked
+// interpolation in interpolateCorrection(), scaled, as maskedStencil() assumes.
+void restrictMasked(const gridtype &p, gridtype &coarse)
+{
+    int M = p.v.m();
+    int Mc = coarse.v.m();
+    int ci = coarseningRatio(M, Mc);
+    int cj = coarseningRatio(p.v.n(), coarse.v.n());
+    double cx = 1.0 / (p.v.Grid().dx() * p.v.Grid().dx());
+    double cy = 1.0 / (p.v.Grid().dy() * p.v.Grid().dy());
+    const double *ptr = p.v.DoubleData().Pointer();
+    const double *ptr_f = p.f.DoubleData().Pointer();
+    const char *inside = p.active.MaskArray().Pointer();
+    double *ptr_c = coarse.f.DoubleData().Pointer();
+    const double weight[3] = {0.25, 0.5, 0.25};
+    parallelColumns(p.exec, Mc, 1, coarse.v.n()-1, [&](int J0, int J1) {
+        forActive(coarse, J0, J1, [&](int kc) {
+            int J = kc / Mc;
+            int I = kc - J*Mc;
+            double sum = 0;
+            for(int b = 1 - cj; b <= cj - 1; b++)
+            {
+                for(int a = 1 - ci; a <= ci - 1; a++)
+                {
+                    int i = ci*I + a;
+                    int j = cj*J + b;
+                    if (!inside[i + j*M]) continue;
+                    double r = maskedResidual(p, ptr, ptr_f, i + j*M, cx, cy);
+                    sum += ((ci == 2) ? weight[a+1] : 1.0) * ((cj == 2) ? weight[b+1] : 1.0) * r;
+                }
+            }
+            ptr_c[kc] = sum;
+        });
+    });
+}
+
+// The max norm of the residual, without storing it
+double residualNorm(const gridtype &p)
+{
+    auto u = p.v.DoubleData();
+    auto fData = p.f.DoubleData();
+    int N = p.v.n();
+    int M = p.v.m();
+    double dx = p.v.Grid().dx();
+    double dy = p.v.Grid().dy();
+    double h2 = dx * dx;
+    double invh2 = 1.0 / h2;
+    double cx = 1.0 / (dx * dx);
+    double cy = 1.0 / (dy * dy);
+
+    const double *ptr = u.Pointer();
+    const double *ptr_f = fData.Pointer();
+    const double *ptr_W = p.A.W.Pointer();
+    const double *ptr_S = p.A.S.Pointer();
+    bool variable = !p.A.W.IsEmpty();
+    bool edges = hasEdges(p.edges);
+    std::atomic<double> norm(0.0);
+    if (p.active.NotEmpty())
+    {
+        parallelColumns(p.exec, M, 1, N-1, [&](int j0, int j1) {
+            double local = 0;
+            forActive(p, j0, j1, [&](int k) {
+                local = std::max(local, std::fabs(maskedResidual(p, ptr, ptr_f, k, cx, cy)));
+            });
+            double current = norm.load();
+            while (local > current && !norm.compare_exchange_weak(current, local));
+        });
+        return norm.load();
+    }
+    parallelColumns(p.exec, M, 1, N-1, [&](int j0, int j1) {
+        double local = 0;
+        if (!variable && !edges && dx == dy)
+        {
+            local = p.exec.kernels->residualNorm(ptr, ptr_f, M, j0, j1, invh2);
+        }
+        else
+        {
+            for(int j = j0; j < j1; j++)
+            {
+                for(int i = 1; i < M-1; i++)
+                {
+                    double r;
+                    if (variable)
+                        r = pointResidual(ptr, ptr_f, ptr_W, ptr_S, M, i, j);
+                    else if (edges)
+                        r = edgeResidual(ptr, ptr_f, M, N, i, j, cx, cy, p.edges);
+                    else
+                        r = pointResidual(ptr, ptr_f, M, i, j, cx, cy);
+                    local = std::max(local, std::fabs(r));
+                }
+            }
+        }
+        double current = norm.load();
+        while (local > current && !norm.compare_exchange_weak(current, local));
+    });
+    return norm.load();
+}
+
+
+// Batched versions of the kernels above, for K systems interleaved per grid point.  The loops
+// over the K systems are innermost and contiguous, so they vectorize without intrinsics.  The
+// interior of a column is one contiguous run of (M-2)*K values, which the Jacobi kernels in
+// StencilKernels handle directly with a neighbour distance of K.  The kernels are templates on
+// the value type, all the arithmetic is done in Real so single precision gets twice the lanes.
+
+inline void batchedJacobi(const StencilKernels *kernels, const double *u, double *unew, const double *f, int M, int K, int j0, int j1, double h2, double omega)
+{
+    kernels->jacobi(u, unew, f, M*K, K, K, (M-1)*K, j0, j1, h2, omega);
+}
+
+inline void batchedJacobi(const StencilKernels *, const float *u, float *unew, const float *f, int M, int K, int j0, int j1, double h2, double omega)
+{
+    float nomega = 1 - omega;
+    float fomega = omega;
+    float fh2 = h2;
+    float factor = 0.25f;
+    int MK = M*K;
+    for(int j = j0; j < j1; j++)
+    {
+        const float *uc = u + j*MK;
+        const float *fc = f + j*MK;
+        float *unc = unew + j*MK;
+        for(int q = K; q < (M-1)*K; q++)
+        {
+            unc[q] = uc[q] * nomega + ((uc[q-K] + uc[q+K] + uc[q-MK] + uc[q+MK] - fc[q]*fh2) * factor) * fomega;
+        }
+    }
+}
+
+template <class Real>
+void batchedRedBlackSweep(Real *ptr, const Real *ptr_f, int M, int K, int j0, int j1, double h2, double omega, int colour)
+{
+    Real nomega = 1 - omega;
+    Real romega = omega;
+    Real rh2 = h2;
+    Real factor = 0.25;
+    int MK = M*K;
+    for(int j = j0; j < j1; j++)
+    {
+        for(int i = 2 - (j + colour) % 2; i < M-1; i += 2)
+        {
+            Real *uc = ptr + (i + j*M)*K;
+            const Real *fc = ptr_f + (i + j*M)*K;
+            for(int r = 0; r < K; r++)
+            {
+                uc[r] = uc[r] * nomega + ((uc[r-K] + uc[r+K] + uc[r-MK] + uc[r+MK] - fc[r]*rh2) * factor) * romega;
+            }
+        }
+    }
+}
+
+template <class Real>
+void relax(batchedgrid<Real> &p, int Niter, double omega, SmootherType smoother, bool reverse = false)
+{
+    int K = p.v.m();
+    int M = p.v.n();
+    int N = p.v.o();
+    double h2 = p.grid.dx() * p.grid.dx();
+    double invh2 = 1.0 / h2;
+    edgetype edges = p.edges;
+    Real *ptr = p.v.Pointer();
+    Real *ptr_new = p.w.Pointer();
+    const Real *ptr_f = p.f.Pointer();
+    if (smoother == JacobiSmoother)
+    {
+        const StencilKernels *kernels = p.exec.kernels;
+        parallelSweeps(p.exec, M, 1, N-1, Niter, [=](int iter, int j0, int j1) {
+            const Real *in = (iter % 2 == 0) ? ptr : ptr_new;
+            Real *out = (iter % 2 == 0) ? ptr_new : ptr;
+            batchedJacobi(kernels, in, out, ptr_f, M, K, j0, j1, h2, omega);
+            jacobiEdges(in, out, ptr_f, M, N, K, invh2, invh2, edges, j0, j1, omega);
+        });
+        if (Niter % 2 == 1)
+            std::swap(p.v, p.w);
+    }
+    else
+    {
+        if (smoother == GaussSeidelSmoother) omega = 1.0;
+        int firstColour = reverse ? 1 : 0;
+        Real *updated = p.edgeScratch.Pointer();
+        parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [=](int sweep, int j0, int j1) {
+            int colour = (sweep + firstColour) % 2;
+            redBlackEdges(ptr, ptr_f, updated, M, N, K, invh2, invh2, edges, j0, j1, omega, colour, [=]() {
+                batchedRedBlackSweep(ptr, ptr_f, M, K, j0, j1, h2, omega, colour);
+            });
+        });
+    }
+}
+
+// Fused residual + full weighting.  With the systems innermost every coarse value simply
+// weights the nine fine residuals around it, which keeps the inner loop free of carried state.
+template <class Real>
+void restrictResidual(const batchedgrid<Real> &p, batchedgrid<Real> &coarse)
+{
+    int K = p.v.m();
+    int M = p.v.n();
+    int N = p.v.o();
+    int Mc = coarse.f.n();
+    int Nc = coarse.f.o();
+    assert(Mc == coarseDim(M) && Nc == coarseDim(N));
+    Real invh2 = 1.0 / (p.grid.dx() * p.grid.dx());
+    edgetype edges = p.edges;
+    bool anyEdges = hasEdges(edges);
+    int MK = M*K;
+
+    const Real *ptr = p.v.Pointer();
+    const Real *ptr_f = p.f.Pointer();
+    Real *ptr_c = coarse.f.Pointer();
+    if (K == 1)
+    {
+        // A single system is a plain array, the scalar kernel reuses the weighted rows
+        parallelColumns(p.exec, M, 1, Nc-1, [=](int J0, int J1) {
+            restrictResidualColumns([=](int i, int j) {
+                if (anyEdges && (i == M-2 || j == N-2))
+                    return edgeResidual(ptr, ptr_f, M, N, i, j, invh2, invh2, edges);
+                return pointResidual(ptr, ptr_f, M, i, j, invh2);
+            }, ptr_c, M, N, Mc, J0, J1);
+        });
+        return;
+    }
+    const Real w[3] = {0.25, 0.5, 0.25};
+    coarse.f = 0;
+    parallelColumns(p.exec, M, 1, Nc-1, [&](int J0, int J1) {
+        for(int J = J0; J < J1; J++)
+        {
+            for(int I = 1; I < Mc-1; I++)
+            {
+                Real *c = ptr_c + (I + J*Mc)*K;
+                for(int dj = -1; dj <= 1; dj++)
+                {
+                    for(int di = -1; di <= 1; di++)
+                    {
+                        if (2*I+di == M-1 || 2*J+dj == N-1) continue;   // the residual is 0 on the boundary
+                        int offset = (2*I+di + (2*J+dj)*M)*K;
+                        const Real *uc = ptr + offset;
+                        const Real *fc = ptr_f + offset;
+                        Real weight = w[di+1] * w[dj+1];
+                        if (anyEdges && (2*I+di == M-2 || 2*J+dj == N-2))
+                        {
+                            edgetype at = edgeAt(edges, M, N, 2*I+di, 2*J+dj);
+                            for(int r = 0; r < K; r++)
+                                c[r] += weight * (fc[r] - edgeLaplacian(uc + r, K, MK, invh2, invh2, at));
+                            continue;
+                        }
+                        for(int r = 0; r < K; r++)
+                        {
+                            c[r] += weight * (fc[r] - (uc[r-K] + uc[r+K] + uc[r-MK] + uc[r+MK] - uc[r] * Real(4)) * invh2);
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+template <class Real>
+void restrictRHS(const batchedgrid<Real> &fine, batchedgrid<Real> &coarse)  // coarsen, for every system
+{
+    int K = fine.f.m();
+    int M = fine.f.n();
+    int N = fine.f.o();
+    int Mc = coarse.f.n();
+    int Nc = coarse.f.o();
+    const Real *ptr = fine.f.Pointer();
+    Real *ptr_c = coarse.f.Pointer();
+    const Real w[3] = {0.25, 0.5, 0.25};
+    coarse.f = 0;
+    parallelColumns(fine.exec, Mc, 1, Nc-1, [&](int J0, int J1) {
+        for(int J = J0; J < J1; J++)
+        {
+            for(int I = 1; I < Mc-1; I++)
+            {
+                Real *c = ptr_c + (I + J*Mc)*K;
+                for(int dj = -1; dj <= 1; dj++)
+                {
+                    for(int di = -1; di <= 1; di++)
+                    {
+                        if (2*I+di == M-1 || 2*J+dj == N-1) continue;   // see coarseDim()
+                        const Real *fc = ptr + (2*I+di + (2*J+dj)*M)*K;
+                        Real weight = w[di+1] * w[dj+1];
+                        for(int r = 0; r < K; r++)
+                            c[r] += weight * fc[r];
+                    }
+                }
+            }
+        }
+    });
+}
+
+template <class Real>
+void addProlongated(const Real *ptr_c, Real *ptr, int M, int N, int Mc, int K, int J0, int J1)
+{
+    // Same as the scalar version, with every value replaced by a run of K values
+    const Real half = 0.5;
+    const Real quarter = 0.25;
+    for(int J = J0; J < J1; J++)
+    {
+        const Real *c0 = ptr_c + J*Mc*K;
+        const Real *c1 = c0 + Mc*K;
+        Real *even = ptr + 2*J*M*K;
+        Real *odd = even + M*K;
+        bool oddInside = (2*J+1 < N-1);
+        for(int I = 0; I < Mc-1; I++)
+        {
+            const Real *a = c0 + I*K;
+            const Real *b = c1 + I*K;
+            bool rowInside = (2*I+1 < M-1);
+            if (J > 0)  // fine column 0 is on the boundary
+            {
+                if (I > 0)
+                    for(int r = 0; r < K; r++)
+                        even[2*I*K + r] += a[r];
+                if (rowInside)
+                    for(int r = 0; r < K; r++)
+                        even[(2*I+1)*K + r] += half * (a[r] + a[r+K]);
+            }
+            if (!oddInside)
+                continue;
+            if (I > 0)
+                for(int r = 0; r < K; r++)
+                    odd[2*I*K + r] += half * (a[r] + b[r]);
+            if (rowInside)
+                for(int r = 0; r < K; r++)
+                    odd[(2*I+1)*K + r] += quarter * (a[r] + a[r+K] + b[r] + b[r+K]);
+        }
+    }
+}
+
+template <class Real>
+void interpolateCorrection(const batchedgrid<Real> &coarse, batchedgrid<Real> &p)
+{
+    int K = p.v.m();
+    int M = p.v.n();
+    int N = p.v.o();
+    int Mc = coarse.v.n();
+    assert(Mc == coarseDim(M) && coarse.v.o() == coarseDim(N));
+    const Real *ptr_c = coarse.v.Pointer();
+    Real *ptr = p.v.Pointer();
+    parallelColumns(p.exec, M, 0, coarse.v.o()-1, [=](int J0, int J1) {
+        if (K == 1)
+            addProlongated(ptr_c, ptr, M, N, Mc, J0, J1);
+        else
+            addProlongated(ptr_c, ptr, M, N, Mc, K, J0, J1);
+    });
+    interpolateEdges(ptr_c, ptr, M, N, Mc, 2, 2, K, p.edges);
+}
+
+template <class Real>
+double residualNorm(const batchedgrid<Real> &p)  // largest residual over all the systems
+{
+    int K = p.v.m();
+    int M = p.v.n();
+    int N = p.v.o();
+    Real invh2 = 1.0 / (p.grid.dx() * p.grid.dx());
+    int MK = M*K;
+    const Real *ptr = p.v.Pointer();
+    const Real *ptr_f = p.f.Pointer();
+    std::atomic<double> norm(0.0);
+    parallelColumns(p.exec, M, 1, N-1, [&](int j0, int j1) {
+        Real local = 0;
+        for(int j = j0; j < j1; j++)
+        {
+            const Real *uc = ptr + j*MK;
+            const Real *fc = ptr_f + j*MK;
+            for(int q = K; q < (M-1)*K; q++)
+            {
+                local = std::max(local, std::fabs(fc[q] - (uc[q-K] + uc[q+K] + uc[q-MK] + uc[q+MK] - uc[q] * Real(4)) * invh2));
+            }
+        }
+        double current = norm.load();
+        while (local > current && !norm.compare_exchange_weak(current, local));
+    });
+    return norm.load();
+}
+
+template <class Real>
+void injectBoundary(const batchedgrid<Real> &fine, batchedgrid<Real> &coarse)
+{
+    int K = fine.v.m();
+    int M = fine.v.n();
+    int N = fine.v.o();
+    int Mc = coarse.v.n();
+    int Nc = coarse.v.o();
+    // A coarse point past the fine boundary takes the value of the nearest boundary point
+    auto i = [=](int I) {return std::min(2*I, M-1);};
+    auto j = [=](int J) {return std::min(2*J, N-1);};
+    for(int r = 0; r < K; r++)
+    {
+        for(int J = 0; J < Nc; J++)
+        {
+            coarse.v(r, 0, J) = coarse.w(r, 0, J) = fine.v(r, 0, j(J));
+            coarse.v(r, Mc-1, J) = coarse.w(r, Mc-1, J) = fine.v(r, M-1, j(J));
+        }
+        for(int I = 0; I < Mc; I++)
+        {
+            coarse.v(r, I, 0) = coarse.w(r, I, 0) = fine.v(r, i(I), 0);
+            coarse.v(r, I, Nc-1) = coarse.w(r, I, Nc-1) = fine.v(r, i(I), N-1);
+        }
+    }
+}
+
+// Copies the boundary of the fine solution onto the coarse solution and its scratch buffer.
+void injectBoundary(const gridtype &fine, gridtype &coarse)
+{
+    auto u = fine.v.DoubleData();
+    auto uc = coarse.v.DoubleData();
+    int Mc = uc.m();
+    int Nc = uc.n();
+    int ci = coarseningRatio(u.m(), Mc);
+    int cj = coarseningRatio(u.n(), Nc);
+    if (coarse.active.NotEmpty())
+    {
+        // The coarse levels of a masked domain hold corrections, restrictRHS() restricts the
+        // residual of the boundary values of the finer level
+        uc = 0;
+        coarse.w = 0;
+        return;
+    }
+    // A coarse point past the fine boundary takes the value of the nearest boundary point
+    int M = u.m();
+    int N = u.n();
+    auto i = [=](int I) {return std::min(ci*I, M-1);};
+    auto j = [=](int J) {return std::min(cj*J, N-1);};
+    for(int J = 0; J < Nc; J++)
+    {
+        uc(0, J) = coarse.w(0, J) = u(0, j(J));
+        uc(Mc-1, J) = coarse.w(Mc-1, J) = u(M-1, j(J));
+    }
+    for(int I = 0; I < Mc; I++)
+    {
+        uc(I, 0) = coarse.w(I, 0) = u(i(I), 0);
+        uc(I, Nc-1) = coarse.w(I, Nc-1) = u(i(I), N-1);
+    }
+}
+
+// The cycles below are written for both gridtype and batchedgridtype, these adapt the
+// single system kernels to the same calls.
+void restrictResidual(const gridtype &p, gridtype &coarse)
+{
+    auto next = coarse.f.DoubleData();
+    if (p.active.NotEmpty())
+    {
+        restrictMasked(p, coarse);
+        return;
+    }
+    restrictResidual(p, next);
+}
+
+void restrictRHS(const gridtype &fine, gridtype &coarse)
+{
+    auto next = coarse.f.DoubleData();
+    if (fine.active.NotEmpty())
+    {
+        // The operators of the coarse levels are for corrections with the value 0 outside of
+        // the active points, see maskedStencil()
+        restrictMasked(fine, coarse);
+        return;
+    }
+    if (!fine.A.W.IsEmpty())
+    {
+        int M = fine.f.m();
+        const double *ptr_f = fine.f.DoubleData().Pointer();
+        restrictVariable(fine.exec, [=](int i, int j) {return *(ptr_f + i + j*M);}, fine.A, next.Pointer(), M, next.m(), next.n(),
+                         coarseningRatio(M, next.m()), coarseningRatio(fine.f.n(), next.n()));
+        return;
+    }
+    coarsen(fine.exec, fine.f.DoubleData(), next);
+}
+
+void interpolateCorrection(const gridtype &coarse, gridtype &p)
+{
+    interpolateCorrection(coarse.v.DoubleData(), p);
+}
+
+// One multigrid cycle for the problem on the given level, using the levels below it for the
+// coarse grid corrections.  A V cycle visits every coarser level once, a W cycle recurses
+// twice on every level and an F cycle does an F cycle followed by a V cycle on the next level.
+// The time spent on each level is added to levelTimes, and the time spent smoothing is returned.
+template <class Grid, class Coarse>
+double mgcycle(Grid *Grids, int level, int depth, const MGParameters &params, CycleType cycle, Coarse &coarse, DTMutableDoubleArray &levelTimes)
+{
+    DTTimer timer;
+    if (level == depth)
+    {
+        // Apply direct solver to the coarsest grid
+        timer.Start();
+        coarse.Solve(Grids[depth]);
+        levelTimes(depth) += timer.Stop();
+        return 0;
+    }
+
+    timer.Start();
+    relax(Grids[level], params.Ndown, params.omega, params.smoother);  // smoothing before restriction
+    double time_smooth = timer.Stop();
+    timer.Start();
+    restrictResidual(Grids[level], Grids[level + 1]);
+    Grids[level + 1].v = 0;     // zero initial guess for the correction
+    levelTimes(level) += time_smooth + timer.Stop();
+
+    switch(cycle)
+    {
+        case VCycle:
+            time_smooth += mgcycle(Grids, level + 1, depth, params, VCycle, coarse, levelTimes);
+            break;
+        case WCycle:
+            time_smooth += mgcycle(Grids, level + 1, depth, params, WCycle, coarse, levelTimes);
+            if (level + 1 < depth)
+                time_smooth += mgcycle(Grids, level + 1, depth, params, WCycle, coarse, levelTimes);
+            break;
+        case FCycle:
+            time_smooth += mgcycle(Grids, level + 1, depth, params, FCycle, coarse, levelTimes);
+            if (level + 1 < depth)
+                time_smooth += mgcycle(Grids, level + 1, depth, params, VCycle, coarse, levelTimes);
+            break;
+    }
+
+    timer.Start();
+    interpolateCorrection(Grids[level + 1], Grids[level]);
+    double time_interpolate = timer.Stop();
+    timer.Start();
+    relax(Grids[level], params.Nup, params.omega, params.smoother, params.symmetric);  // smoothing after interpolation
+    double time_relax = timer.Stop();
+    time_smooth += time_relax;
+    levelTimes(level) += time_interpolate + time_relax;
+    return time_smooth;
+}
+
+// Full multigrid (nested iteration): restrict the right hand side to every level, solve on the
+// coarsest grid and then interpolate the solution up one level at a time, doing params.Nfmg
+// cycles on each level.  Assumes the interior of the solution on the finest level is zero.
+template <class Grid, class Coarse>
+double fullMultiGrid(Grid *Grids, int depth, const MGParameters &params, Coarse &coarse, DTMutableDoubleArray &levelTimes)
+{
+    for(int d = 1; d <= depth; d++)
+    {
+        restrictRHS(Grids[d-1], Grids[d]);
+        injectBoundary(Grids[d-1], Grids[d]);
+    }
+
+    coarse.Solve(Grids[depth]);
+
+    double time = 0;
+    for(int d = depth-1; d >= 0; d--)
+    {
+        interpolateCorrection(Grids[d+1], Grids[d]);
+        // The coarser levels hold corrections with zero boundary values from now on.
+        for(int c = d+1; c <= depth; c++)
+        {
+            Grids[c].v = 0;
+            Grids[c].w = 0;
+        }
+        for(int iter = 0; iter < params.Nfmg; iter++)
+            time += mgcycle(Grids, d, depth, params, params.cycle, coarse, levelTimes);
+    }
+    return time;
+}
+
+// Does up to params.Nv cycles on the hierarchy, with a full multigrid pass as the first one
+// if requested, and stops early once the residual tolerance is met.
+template <class Grid, class Coarse>
+MGOutputs runCycles(Grid *Grids, int depth, const MGParameters &params, Coarse &coarse, bool pureJacobi)
+{
+    int Nv = params.Nv;
+    DTMutableDoubleArray resnorm(Nv+1);
+    DTMutableDoubleArray times(Nv+1);
+    DTMutableDoubleArray levelTimes(depth+1);
+    levelTimes = 0;
+    resnorm(0) = residualNorm(Grids[0]);
+    times(0) = 0;
+    int done = 0;
+    while (done < Nv)
+    {
+        double time_singleV = 0;
+        if (pureJacobi)
+        {
+            DTTimer timer;
+            timer.Start();
+            relax(Grids[0], 1, params.omega, params.smoother);
+            time_singleV = timer.Stop();
+        }
+        else if (params.fmg && done == 0)
+        {
+            time_singleV = fullMultiGrid(Grids, depth, params, coarse, levelTimes);
+        }
+        else
+        {
+            time_singleV = mgcycle(Grids, 0, depth, params, params.cycle, coarse, levelTimes);
+        }
+        times(done+1) = times(done) + time_singleV;
+        resnorm(done+1) = residualNorm(Grids[0]);
+//        printf("iteration %d: residual=%.20f\n", done+1, resnorm(done+1));
+        done++;
+        if (resnorm(done) <= params.atol || resnorm(done) <= params.rtol * resnorm(0))
+            break;
+    }
+    if (done < Nv)
+    {
+        resnorm = TruncateSize(resnorm, done+1);
+        times = TruncateSize(times, done+1);
+    }
+    return MGOutputs(resnorm, times, levelTimes);
+}
+
+// The full approximation scheme for the nonlinear problem Laplacian(u) - lambda e^u = f, which
+// is monotone for lambda >= 0.  The smoothers do one Newton step for the equation of every
+// point with its neighbours fixed, which for lambda = 0 is the linear Jacobi or Gauss-Seidel
+// update.  Only the Laplacian with constant spacings is supported.
+inline double nonlinearOperator(const double *ptr, int M, int i, int j, double cx, double cy, double lambda)
+{
+    const double *u = ptr + i + j*M;
+    return cx * (u[-1] + u[1] - 2.0 * u[0]) + cy * (u[-M] + u[M] - 2.0 * u[0]) - lambda * std::exp(u[0]);
+}
+
+void nonlinearJacobi(const double *ptr, double *ptr_new, const double *ptr_f, int M, int j0, int j1, double cx, double cy, double lambda, double omega)
+{
+    double diagonal = 2*cx + 2*cy;
+    for(int j = j0; j < j1; j++)
+    {
+        for(int i = 1; i < M-1; i++)
+        {
+            int k = i + j*M;
+            double r = ptr_f[k] - nonlinearOperator(ptr, M, i, j, cx, cy, lambda);
+            ptr_new[k] = ptr[k] - omega * r / (diagonal + lambda * std::exp(ptr[k]));
+        }
+    }
+}
+
+void nonlinearRedBlackSweep(double *ptr, const double *ptr_f, int M, int j0, int j1, double cx, double cy, double lambda, double omega, int colour)
+{
+    double diagonal = 2*cx + 2*cy;
+    for(int j = j0; j < j1; j++)
+    {
+        for(int i = 2 - (j + colour) % 2; i < M-1; i += 2)
+        {
+            int k = i + j*M;
+            double r = ptr_f[k] - nonlinearOperator(ptr, M, i, j, cx, cy, lambda);
+            ptr[k] -= omega * r / (diagonal + lambda * std::exp(ptr[k]));
+        }
+    }
+}
+
+void relaxNonlinear(gridtype &p, int Niter, double omega, double lambda, SmootherType smoother, bool reverse = false)
+{
+    auto u = p.v.DoubleData();
+    int N = p.v.n();
+    int M = p.v.m();
+    double cx = 1.0 / (p.v.Grid().dx() * p.v.Grid().dx());
+    double cy = 1.0 / (p.v.Grid().dy() * p.v.Grid().dy());
+    double *ptr = u.Pointer();
+    const double *ptr_f = p.f.DoubleData().Pointer();
+    if (smoother != JacobiSmoother)
+    {
+        double factor = (smoother == SORSmoother) ? omega : 1.0;
+        int firstColour = reverse ? 1 : 0;
+        parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [=](int sweep, int j0, int j1) {
+            nonlinearRedBlackSweep(ptr, ptr_f, M, j0, j1, cx, cy, lambda, factor, (sweep + firstColour) % 2);
+        });
+        return;
+    }
+    double *ptr_new = p.w.Pointer();
+    parallelSweeps(p.exec, M, 1, N-1, Niter, [=](int iter, int j0, int j1) {
+        if (iter % 2 == 0)
+            nonlinearJacobi(ptr, ptr_new, ptr_f, M, j0, j1, cx, cy, lambda, omega);
+        else
+            nonlinearJacobi(ptr_new, ptr, ptr_f, M, j0, j1, cx, cy, lambda, omega);
+    });
+    if (Niter % 2 == 1)
+    {
+        DTMutableDoubleArray latest = p.w;
+        p.w = u;
+        p.v = DTMutableMesh2D(p.v.Grid(), latest);
+    }
+}
+
+double nonlinearResidualNorm(const gridtype &p, double lambda)
+{
+    auto u = p.v.DoubleData();
+    int N = p.v.n();
+    int M = p.v.m();
+    double cx = 1.0 / (p.v.Grid().dx() * p.v.Grid().dx());
+    double cy = 1.0 / (p.v.Grid().dy() * p.v.Grid().dy());
+    const double *ptr = u.Pointer();
+    const double *ptr_f = p.f.DoubleData().Pointer();
+    std::atomic<double> norm(0.0);
+    parallelColumns(p.exec, M, 1, N-1, [&](int j0, int j1) {
+        double local = 0;
+        for(int j = j0; j < j1; j++)
+            for(int i = 1; i < M-1; i++)
+                local = std::max(local, std::fabs(ptr_f[i + j*M] - nonlinearOperator(ptr, M, i, j, cx, cy, lambda)));
+        double current = norm.load();
+        while (local > current && !norm.compare_exchange_weak(current, local));
+    });
+    return norm.load();
+}
+
+// The right hand side of the coarse level, the restricted fine residual plus the coarse
+// operator applied to the restricted approximation, which is in coarse.v already.
+void restrictNonlinear(const gridtype &p, gridtype &coarse, double lambda)
+{
+    int M = p.v.m();
+    int Mc = coarse.v.m();
+    int Nc = coarse.v.n();
+    int ci = coarseningRatio(M, Mc);
+    int cj = coarseningRatio(p.v.n(), Nc);
+    double cx = 1.0 / (p.v.Grid().dx() * p.v.Grid().dx());
+    double cy = 1.0 / (p.v.Grid().dy() * p.v.Grid().dy());
+    const double *ptr = p.v.DoubleData().Pointer();
+    const double *ptr_f = p.f.DoubleData().Pointer();
+    double *ptr_c = coarse.f.DoubleData().Pointer();
+    restrictLevel(p.exec, [=](int i, int j) {return ptr_f[i + j*M] - nonlinearOperator(ptr, M, i, j, cx, cy, lambda);}, ptr_c, M, p.v.n(), Mc, Nc, ci, cj);
+
+    double cxc = 1.0 / (coarse.v.Grid().dx() * coarse.v.Grid().dx());
+    double cyc = 1.0 / (coarse.v.Grid().dy() * coarse.v.Grid().dy());
+    const double *ptr_vc = coarse.v.DoubleData().Pointer();
+    parallelColumns(p.exec, Mc, 1, Nc-1, [=](int j0, int j1) {
+        for(int j = j0; j < j1; j++)
+            for(int i = 1; i < Mc-1; i++)
+                ptr_c[i + j*Mc] += nonlinearOperator(ptr_vc, Mc, i, j, cxc, cyc, lambda);
+    });
+}
+
+// Newton's method on the coarsest level, from the current values of u.  The Jacobian changes
+// with u so it is factored on every step, the coarsest level is small.
+void CoarseSolver::SolveNonlinear(gridtype &p, double lambda)
+{
+    auto u = p.v.DoubleData();
+    const double *ptr_f = p.f.DoubleData().Pointer();
+    assert(u.m() == M && u.n() == N);
+    double dx = p.v.Grid().dx();
+    double h2 = dx * dx;
+    double cx = 1.0 / h2;
+    double cy = 1.0 / (p.v.Grid().dy() * p.v.Grid().dy());
+    SpMat laplacian = laplacianMatrix(M, N, r);
+    Eigen::SimplicialCholesky<SpMat> newton;
+    Eigen::VectorXd rhs((M-2)*(N-2));
+    for(int iter = 0; iter < 50; iter++)
+    {
+        // (-Laplacian + lambda e^u) du = -residual, scaled by dx^2 like laplacianMatrix()
+        SpMat jacobian = laplacian;
+        int cnt = 0;
+        for(int j = 1; j < N-1; j++)
+        {
+            for(int i = 1; i < M-1; i++)
+            {
+                rhs[cnt] = -h2 * (ptr_f[i + j*M] - nonlinearOperator(u.Pointer(), M, i, j, cx, cy, lambda));
+                jacobian.coeffRef(cnt, cnt) += h2 * lambda * std::exp(u(i, j));
+                cnt++;
+            }
+        }
+        if (iter == 0)
+            newton.analyzePattern(jacobian);
+        newton.factorize(jacobian);
+        if (newton.info() != Eigen::Success)
+        {
+            printf("Error: Factorization of the %dx%d coarse grid Jacobian failed!\n", M, N);
+            exit(1);
+        }
+        Eigen::VectorXd du = newton.solve(rhs);
+        double change = 0, size = 1;
+        cnt = 0;
+        for(int j = 1; j < N-1; j++)
+        {
+            for(int i = 1; i < M-1; i++)
+            {
+                u(i, j) += du[cnt++];
+                change = std::max(change, std::fabs(du[cnt-1]));
+                size = std::max(size, std::fabs(u(i, j)));
+            }
+        }
+        if (change <= 1e-14 * size)
+            break;
+    }
+}
+
+// One FAS cycle on the given level.  The coarse levels carry full approximations: the fine
+// approximation is restricted with coarsen(), the coarse right hand side is computed by
+// restrictNonlinear(), and the change of the coarse solution from the restricted approximation,
+// kept in restricted[level+1], is interpolated back as the correction.
+double fascycle(gridtype *Grids, DTMutableDoubleArray *restricted, int level, int depth, const MGParameters &params, CycleType cycle, CoarseSolver &coarse, DTMutableDoubleArray &levelTimes)
+{
+    DTTimer timer;
+    if (level == depth)
+    {
+        timer.Start();
+        coarse.SolveNonlinear(Grids[depth], params.lambda);
+        levelTimes(depth) += timer.Stop();
+        return 0;
+    }
+
+    timer.Start();
+    relaxNonlinear(Grids[level], params.Ndown, params.omega, params.lambda, params.smoother);
+    double time_smooth = timer.Stop();
+    timer.Start();
+    auto next = Grids[level + 1].v.DoubleData();
+    coarsen(Grids[level].exec, Grids[level].v.DoubleData(), next);
+    injectBoundary(Grids[level], Grids[level + 1]);
+    CopyValues(restricted[level + 1], next);
+    restrictNonlinear(Grids[level], Grids[level + 1], params.lambda);
+    levelTimes(level) += time_smooth + timer.Stop();
+
+    switch(cycle)
+    {
+        case VCycle:
+            time_smooth += fascycle(Grids, restricted, level + 1, depth, params, VCycle, coarse, levelTimes);
+            break;
+        case WCycle:
+            time_smooth += fascycle(Grids, restricted, level + 1, depth, params, WCycle, coarse, levelTimes);
+            if (level + 1 < depth)
+                time_smooth += fascycle(Grids, restricted, level + 1, depth, params, WCycle, coarse, levelTimes);
+            break;
+        case FCycle:
+            time_smooth += fascycle(Grids, restricted, level + 1, depth, params, FCycle, coarse, levelTimes);
+            if (level + 1 < depth)
+                time_smooth += fascycle(Grids, restricted, level + 1, depth, params, VCycle, coarse, levelTimes);
+            break;
+    }
+
+    timer.Start();
+    // The smoother may have swapped the coarse solution into its scratch buffer
+    auto solved = Grids[level + 1].v.DoubleData();
+    const double *ptr_r = restricted[level + 1].Pointer();
+    double *ptr_c = solved.Pointer();
+    for(int k = 0; k < solved.Length(); k++)
+        ptr_c[k] -= ptr_r[k];
+    interpolateCorrection(Grids[level + 1], Grids[level]);
+    double time_interpolate = timer.Stop();
+    timer.Start();
+    relaxNonlinear(Grids[level], params.Nup, params.omega, params.lambda, params.smoother, params.symmetric);
+    double time_relax = timer.Stop();
+    time_smooth += time_relax;
+    levelTimes(level) += time_interpolate + time_relax;
+    return time_smooth;
+}
+
+// Full multigrid with FAS cycles: the problem is restricted to every level, solved on the
+// coarsest one, and the solution of each level is the initial guess of the next finer one.
+// Assumes the interior of the solution on the finest level is zero.
+double fasFullMultiGrid(gridtype *Grids, DTMutableDoubleArray *restricted, int depth, const MGParameters &params, CoarseSolver &coarse, DTMutableDoubleArray &levelTimes)
+{
+    for(int d = 1; d <= depth; d++)
+    {
+        restrictRHS(Grids[d-1], Grids[d]);
+        Grids[d].v = 0;
+        injectBoundary(Grids[d-1], Grids[d]);
+    }
+    coarse.SolveNonlinear(Grids[depth], params.lambda);
+
+    double time = 0;
+    for(int d = depth-1; d >= 0; d--)
+    {
+        interpolateCorrection(Grids[d+1], Grids[d]);
+        for(int iter = 0; iter < params.Nfmg; iter++)
+            time += fascycle(Grids, restricted, d, depth, params, params.cycle, coarse, levelTimes);
+    }
+    return time;
+}
+
+// Computes invD and the interpolation weights from the couplings.  Along the boundary the
+// interpolation is linear, like the boundary values.
+void finishStencil(stenciltype &A)
+{
+    int M = A.W.m();
+    int N = A.W.n();
+    A.invD = DTMutableDoubleArray(M, N);
+    A.Px = DTMutableDoubleArray(M, N);
+    A.Py = DTMutableDoubleArray(M, N);
+    A.invD = 0;
+    A.Px = 0.5;
+    A.Py = 0.5;
+    for(int j = 1; j < N-1; j++)
+    {
+        for(int i = 1; i < M-1; i++)
+        {
+            A.invD(i, j) = 1.0 / (A.W(i, j) + A.W(i+1, j) + A.S(i, j) + A.S(i, j+1));
+            A.Px(i, j) = A.W(i, j) / (A.W(i, j) + A.W(i+1, j));
+            A.Py(i, j) = A.S(i, j) / (A.S(i, j) + A.S(i, j+1));
+        }
+    }
+}
+
+
+// The finest level for the coefficient a given at the grid points.  Two neighbours are coupled
+// by the harmonic mean of their a, which keeps the flux continuous across jumps in a.
+stenciltype fineStencil(const DTDoubleArray &a, double dx, double dy)
+{
+    int M = a.m();
+    int N = a.n();
+    stenciltype A;
+    A.W = DTMutableDoubleArray(M, N);
+    A.S = DTMutableDoubleArray(M, N);
+    A.W = 0;
+    A.S = 0;
+    for(int j = 0; j < N; j++)
+    {
+        for(int i = 0; i < M; i++)
+        {
+            if (i > 0) A.W(i, j) = 2.0 * a(i-1, j) * a(i, j) / (a(i-1, j) + a(i, j)) / (dx * dx);
+            if (j > 0) A.S(i, j) = 2.0 * a(i, j-1) * a(i, j) / (a(i, j-1) + a(i, j)) / (dy * dy);
+        }
+    }
+    finishStencil(A);
+    return A;
+}
+
+// The coarse level by harmonic averaging.  Along a coarsened direction the two fine couplings
+// between coarse neighbours act in series, across it the (1/4)[1 2 1] average of the three
+// fine rows or columns is taken.
+stenciltype harmonicStencil(const stenciltype &fine, int Mc, int Nc, int ci, int cj)
+{
+    const double w[3] = {0.25, 0.5, 0.25};
+    stenciltype A;
+    A.W = DTMutableDoubleArray(Mc, Nc);
+    A.S = DTMutableDoubleArray(Mc, Nc);
+    A.W = 0;
+    A.S = 0;
+    for(int J = 1; J < Nc-1; J++)
+    {
+        for(int I = 1; I < Mc; I++)
+        {
+            for(int d = -1; d <= 1; d++)
+            {
+                if (cj == 1 && d != 0) continue;
+                int j = cj*J + d;
+                double weight = (cj == 2) ? w[d+1] : 1.0;
+                double series = (ci == 2) ? 0.5 / (1.0 / fine.W(2*I-1, j) + 1.0 / fine.W(2*I, j)) : fine.W(I, j);
+                A.W(I, J) += weight * series;
+            }
+        }
+    }
+    for(int J = 1; J < Nc; J++)
+    {
+        for(int I = 1; I < Mc-1; I++)
+        {
+            for(int d = -1; d <= 1; d++)
+            {
+                if (ci == 1 && d != 0) continue;
+                int i = ci*I + d;
+                double weight = (ci == 2) ? w[d+1] : 1.0;
+                double series = (cj == 2) ? 0.5 / (1.0 / fine.S(i, 2*J-1) + 1.0 / fine.S(i, 2*J)) : fine.S(i, J);
+                A.S(I, J) += weight * series;
+            }
+        }
+    }
+    finishStencil(A);
+    return A;
+}
+
+// The Galerkin coarse level R A P, with the interpolation P of the cycle and its transpose R,
+// scaled to the full weighting, in the coarsened directions.  R A P has nine points, it is collapsed to five by
+// adding every diagonal coupling to the two couplings next to it.  That keeps the first and
+// second moments of every row, so the Laplacian collapses to the Laplacian of the coarse grid.
+// The rows are not exactly symmetric after the collapse, the coupling of two points is the
+// mean of their two rows.
+stenciltype galerkinStencil(const stenciltype &fine, int Mc, int Nc, int ci, int cj)
+{
+    int M = fine.W.m();
+    double scale = 1.0 / (ci * cj);
+    DTMutableDoubleArray west(Mc, Nc), east(Mc, Nc), south(Mc, Nc), north(Mc, Nc);
+    for(int J = 1; J < Nc-1; J++)
+    {
+        for(int I = 1; I < Mc-1; I++)
+        {
+            double c[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};    // c[dI+1][dJ+1]
+            for(int b = -1; b <= 1; b++)
+            {
+                if (cj == 1 && b != 0) continue;
+                for(int a = -1; a <= 1; a++)
+                {
+                    if (ci == 1 && a != 0) continue;
+                    int i = ci*I + a;
+                    int j = cj*J + b;
+                    double r = scale * prolongationWeight(fine, M, i, j, a, b);
+                    // Row (i,j) of A, and the interpolation of its points from the coarse points
+                    // around C
+                    const int qi[5] = {0, -1, 1, 0, 0};
+                    const int qj[5] = {0, 0, 0, -1, 1};
+                    double value[5] = {0, fine.W(i, j), fine.W(i+1, j), fine.S(i, j), fine.S(i, j+1)};
+                    value[0] = -(value[1] + value[2] + value[3] + value[4]);
+                    for(int q = 0; q < 5; q++)
+                    {
+                        for(int dJ = -1; dJ <= 1; dJ++)
+                        {
+                            int y = b + qj[q] - cj*dJ;
+                            if (y < -1 || y > 1 || (cj == 1 && y != 0)) continue;
+                            for(int dI = -1; dI <= 1; dI++)
+                            {
+                                int x = a + qi[q] - ci*dI;
+                                if (x < -1 || x > 1 || (ci == 1 && x != 0)) continue;
+                                c[dI+1][dJ+1] += r * value[q] * prolongationWeight(fine, M, i + qi[q], j + qj[q], x, y);
+                            }
+                        }
+                    }
+                }
+            }
+            west(I, J) = c[0][1] + c[0][0] + c[0][2];
+            east(I, J) = c[2][1] + c[2][0] + c[2][2];
+            south(I, J) = c[1][0] + c[0][0] + c[2][0];
+            north(I, J) = c[1][2] + c[0][2] + c[2][2];
+        }
+    }
+
+    stenciltype A;
+    A.W = DTMutableDoubleArray(Mc, Nc);
+    A.S = DTMutableDoubleArray(Mc, Nc);
+    A.W = 0;
+    A.S = 0;
+    for(int J = 1; J < Nc-1; J++)
+    {
+        for(int I = 1; I < Mc; I++)
+        {
+            if (I == 1) A.W(I, J) = west(I, J);
+            else if (I == Mc-1) A.W(I, J) = east(I-1, J);
+            else A.W(I, J) = 0.5 * (west(I, J) + east(I-1, J));
+        }
+    }
+    for(int J = 1; J < Nc; J++)
+    {
+        for(int I = 1; I < Mc-1; I++)
+        {
+            if (J == 1) A.S(I, J) = south(I, J);
+            else if (J == Nc-1) A.S(I, J) = north(I, J-1);
+            else A.S(I, J) = 0.5 * (south(I, J) + north(I, J-1));
+        }
+    }
+    finishStencil(A);
+    return A;
+}
+
+// The Galerkin coarse level R A P of a masked domain.  P is the interpolation of the cycle,
+// bilinear from the coarse points to the active fine points, and R its transpose scaled to the
+// full weighting, see restrictMasked().  The points without an equation hold the correction 0,
+// so P and A leave them out and the rows next to the edge of the domain do not add up to 0.
+// inside marks the active coarse points, those P interpolates from.  R A P has nine points and
+// they are all kept: collapsing them to five changes the rows along the edge, and the change
+// grows from level to level.
+stenciltype maskedStencil(const gridtype &fine, const DTCharArray &inside, int ci, int cj)
+{
+    int M = fine.v.m();
+    int Mc = inside.m();
+    int Nc = inside.n();
+    double scale = 1.0 / (ci * cj);
+    const char *active = fine.active.MaskArray().Pointer();
+    double cx = 1.0 / (fine.v.Grid().dx() * fine.v.Grid().dx());
+    double cy = 1.0 / (fine.v.Grid().dy() * fine.v.Grid().dy());
+    // Weight of a coarse point in the interpolation of the fine point x away from it
+    auto weight = [](int x, int c) {return (x == 0) ? 1.0 : ((c == 2 && std::abs(x) == 1) ? 0.5 : 0.0);};
+    // The offsets of the nine points of a row, the centre first
+    const int qi[9] = {0, -1, 1, 0, 0, -1, 1, 1, -1};
+    const int qj[9] = {0, 0, 0, -1, 1, -1, 1, -1, 1};
+
+    stenciltype A;
+    A.W = DTMutableDoubleArray(Mc, Nc);
+    A.S = DTMutableDoubleArray(Mc, Nc);
+    A.SW = DTMutableDoubleArray(Mc, Nc);
+    A.SE = DTMutableDoubleArray(Mc, Nc);
+    A.invD = DTMutableDoubleArray(Mc, Nc);
+    A.W = 0;
+    A.S = 0;
+    A.SW = 0;
+    A.SE = 0;
+    A.invD = 0;
+    for(int J = 1; J < Nc-1; J++)
+    {
+        for(int I = 1; I < Mc-1; I++)
+        {
+            if (!inside(I, J)) continue;
+            double c[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};    // c[dI+1][dJ+1]
+            for(int b = 1 - cj; b <= cj - 1; b++)
+            {
+                for(int a = 1 - ci; a <= ci - 1; a++)
+                {
+                    int k = (ci*I + a) + (cj*J + b)*M;
+                    if (!active[k]) continue;
+                    double r = scale * weight(a, ci) * weight(b, cj);
+                    // Row k of A, the Laplacian on the finest level
+                    double value[9] = {-(2*cx + 2*cy), cx, cx, cy, cy, 0, 0, 0, 0};
+                    if (fine.A.W.NotEmpty())
+                    {
+                        const stenciltype &F = fine.A;
+                        double row[9] = {-1.0 / F.invD(k), F.W(k), F.W(k+1), F.S(k), F.S(k+M),
+                                         F.SW(k), F.SW(k+1+M), F.SE(k), F.SE(k-1+M)};
+                        std::copy(row, row + 9, value);
+                    }
+                    for(int q = 0; q < 9; q++)
+                    {
+                        if (value[q] == 0 || !active[k + qi[q] + qj[q]*M]) continue;
+                        for(int dJ = -1; dJ <= 1; dJ++)
+                            for(int dI = -1; dI <= 1; dI++)
+                                c[dI+1][dJ+1] += r * value[q] * weight(a + qi[q] - ci*dI, ci) * weight(b + qj[q] - cj*dJ, cj);
+                    }
+                }
+            }
+            // R A P is symmetric, so every coupling is stored from the row of its upper point
+            A.W(I, J) = c[0][1];
+            A.S(I, J) = c[1][0];
+            A.SW(I, J) = c[0][0];
+            A.SE(I, J) = c[2][0];
+            A.invD(I, J) = -1.0 / c[1][1];
+        }
+    }
+    return A;
+}
+
+// Owns the grid hierarchy, the scratch buffers, the coarse grid factorization and the thread
+// team.  Setup() allocates everything for one fine grid, after which Solve() can be called any
+// number of times for right hand sides on that grid without allocating.
+class MultigridSolver
+{
+public:
+    explicit MultigridSolver(const MGParameters &_params) : params(_params), depth(0) {}
+
+    // a is the coefficient of div(a grad u) at the grid points, empty for the Laplacian
+    void Setup(const DTMesh2DGrid &grid, const DTDoubleArray &a = DTDoubleArray());
+
+    // Solves with the right hand side f.  u holds the boundary values and the initial guess on
+    // entry and the solution on return.  A full multigrid pass ignores the interior of u.
+    MGOutputs Solve(const DTDoubleArray &f, DTMutableDoubleArray &u, bool pureJacobi = false);
+
+private:
+    MGOutputs SolveCG(const DTDoubleArray &f, DTMutableDoubleArray &u);
+    MGOutputs SolveMixed(const DTDoubleArray &f, DTMutableDoubleArray &u);
+    MGOutputs SolveFAS(const DTDoubleArray &f, DTMutableDoubleArray &u);
+    void precondition();
+    double sumColumns() const;
+
+    MGParameters params;
+    int depth;
+    std::vector<gridtype> Grids;        // only the finest level in mixed precision
+    std::vector<floatgridtype> FloatGrids;  // the single precision hierarchy for the corrections
+    CoarseSolver coarse;
+    std::unique_ptr<ThreadTeam> team;   // lives as long as the solver, the exec of every level points to it
+    DTMutableDoubleArray x, p, q;       // conjugate gradient vectors, the residual and the
+                                        // preconditioned residual live in Grids[0].f and Grids[0].v
+    DTMutableDoubleArray columnSums;    // partial dot products, summed in order so the result does not depend on the threads
+    DTMutableDoubleArray levelTimes;
+    std::vector<DTMutableDoubleArray> restricted;   // FAS: the restricted approximation of every level
+};
+
+// A direction is halved while it has more than sqrt(2) times --coarsest intervals, which is
+// the old rule for the depth of a square 2^k+1 grid.  An odd number of intervals is halved
+// rounding up, see coarseDim(), unless oddIntervals is false: the transfers of a coefficient
+// a, of FAS and of the other boundary conditions need every coarse point to be a fine point.
+bool canCoarsen(int dim, int coarsest, bool oddIntervals = false)
+{
+    return (oddIntervals || (dim - 1) % 2 == 0) && (dim - 1) > coarsest * std::sqrt(2.0);
+}
+
+// The direct solve of a level that could not be coarsened only because of an odd number of
+// intervals is slow, 17 s for 1000 x 1000 and over two minutes for 50^3.  Such hierarchies are
+// refused when the estimated cost of the factorization is over this, about that of 630 x 630
+// unknowns in 2D or 25^3 in 3D, which take a few seconds.
+const double MaxCoarsestCost = 2.5e8;
+
+// The smallest --coarsest for a masked domain.  Below about 16 intervals the domain is a few
+// coarse cells across and the Galerkin operators of those levels are poor approximations of
+// the finer ones, so the rate of the cycle grew with every level added below them.
+const int MaskedCoarsest = 16;
+
+// Exits when parity, an odd number of the intervals or cells in some direction, stopped the
+// coarsening at a level that is too expensive to factor.  The sparse Cholesky factorization of
+// n unknowns takes about n^1.5 operations in 2D and n^2 in 3D with a fill-reducing ordering.
+void refuseCoarsest(const std::vector<int> &unknowns, bool parity, const char *what)
+{
+    double n = 1;
+    for(size_t d = 0; d < unknowns.size(); d++)
+        n *= unknowns[d];
+    double cost = std::pow(n, (unknowns.size() == 2) ? 1.5 : 2.0);
+    if (parity && cost > MaxCoarsestCost)
+    {
+        printf("Error: The coarsest level would have %.0f unknowns because an odd number of %s can not be halved here, use sizes with more factors of 2 in the number of %s!\n", n, what, what);
+        exit(1);
+    }
+}
+
+void checkCoarsest(const std::vector<int> &dims, int coarsest)
+{
+    std::vector<int> unknowns;
+    bool parity = false;
+    for(size_t d = 0; d < dims.size(); d++)
+    {
+        unknowns.push_back(dims[d] - 2);
+        parity = parity || (!canCoarsen(dims[d], coarsest) && canCoarsen(dims[d], coarsest, true));
+    }
+    refuseCoarsest(unknowns, parity, "intervals");
+}
+
+enum CoarseningType
+{
+    FullCoarsening,     // both directions together, the hierarchy ends when either one can not be halved
+    SemiCoarsening,     // each direction on its own, and only while its spacing is not the larger one
+    LineCoarsening      // each direction on its own for as long as it can be halved
+};
+
+// The grids of the hierarchy, finest first.  Semi-coarsening halves only the strongly coupled
+// direction of a stretched grid, so the cells stay within a factor of two of square and point
+// smoothers keep working.  Line relaxation handles any aspect ratio, so with it a direction is
+// halved whenever it can be.
+std::vector<DTMesh2DGrid> levelGrids(const DTMesh2DGrid &grid, int coarsest, CoarseningType coarsening, bool oddIntervals = false)
+{
+    std::vector<DTMesh2DGrid> grids(1, grid);
+    while (true)
+    {
+        DTMesh2DGrid level = grids.back();
+        bool cx = canCoarsen(level.m(), coarsest, oddIntervals);
+        bool cy = canCoarsen(level.n(), coarsest, oddIntervals);
+        if (coarsening == SemiCoarsening)
+        {
+            cx = cx && level.dx() <= level.dy();
+            cy = cy && level.dy() <= level.dx();
+        }
+        else if (coarsening == FullCoarsening && (!cx || !cy))
+            break;
+        if (!cx && !cy)
+            break;
+        grids.push_back(DTMesh2DGrid(level.Origin(), cx ? level.dx() * 2.0 : level.dx(), cy ? level.dy() * 2.0 : level.dy(),
+                                     cx ? coarseDim(level.m()) : level.m(), cy ? coarseDim(level.n()) : level.n()));
+    }
+    if (!oddIntervals)
+        checkCoarsest({grids.back().m(), grids.back().n()}, coarsest);
+    return grids;
+}
+
+// Marks the points of a level of a masked domain that have an equation and indexes their
+// intervals by column.
+void setActive(gridtype &p, const DTCharArray &inside)
+{
+    int M = inside.m();
+    int N = inside.n();
+    p.active = DTMask(inside);
+    DTIntArray intervals = p.active.Intervals();
+    DTMutableIntArray first(N+1);
+    int n = 0;
+    for(int j = 0; j <= N; j++)
+    {
+        while (n < intervals.n() && intervals(0, n) < j*M)
+            n++;
+        first(j) = n;
+    }
+    p.firstInterval = first;
+}
+
+void MultigridSolver::Setup(const DTMesh2DGrid &grid, const DTDoubleArray &a)
+{
+    CoarseningType coarsening = SemiCoarsening;
+    if (params.mixed)
+        coarsening = FullCoarsening;
+    else if (params.smoother == LineSmoother)
+        coarsening = LineCoarsening;
+    // The transfers of a coefficient a and of FAS, and the line smoother, need even numbers of
+    // intervals.  The operators of a masked domain are Galerkin operators for any intervals.
+    bool oddIntervals = a.IsEmpty() && !params.fas && params.smoother != LineSmoother;
+    int threshold = grid.MaskDefined() ? std::max(params.coarsest, MaskedCoarsest) : params.coarsest;
+    std::vector<DTMesh2DGrid> levels = levelGrids(grid, threshold, coarsening, oddIntervals);
+    depth = int(levels.size()) - 1;
+    Grids.assign(params.mixed ? 1 : depth + 1, gridtype());
+    FloatGrids.assign(params.mixed ? depth + 1 : 0, floatgridtype());
+
+    // Allocate memory just once
+    edgetype edges;
+    for(int d = 0; d <= depth; d++)
+    {
+        const DTMesh2DGrid &levelGrid = levels[d];
+        if (d > 0 && !grid.MaskDefined())
+            edges = coarseEdges(edges, levels[d-1], levelGrid);
+        if (d < int(Grids.size()))
+        {
+            DTMutableDoubleArray dData(levelGrid.m(), levelGrid.n());
+            dData = 0;
+            Grids[d].f = DTMutableMesh2D(levelGrid, dData.Copy());
+            Grids[d].v = DTMutableMesh2D(levelGrid, dData.Copy());
+            Grids[d].w = dData;
+            Grids[d].edges = edges;
+            if (hasEdges(edges))
+                Grids[d].edgeScratch = DTMutableDoubleArray(levelGrid.m() + levelGrid.n());
+        }
+        if (params.mixed)
+        {
+            DTMutableFloatArray fData(1, levelGrid.m(), levelGrid.n());
+            fData = 0;
+            FloatGrids[d].grid = levelGrid;
+            FloatGrids[d].f = fData.Copy();
+            FloatGrids[d].v = fData.Copy();
+            FloatGrids[d].w = fData;
+            FloatGrids[d].edges = edges;
+            if (hasEdges(edges))
+                FloatGrids[d].edgeScratch = DTMutableFloatArray(levelGrid.m() + levelGrid.n());
+        }
+    }
+    // The operators of all the levels are built once here
+    if (!a.IsEmpty())
+    {
+        Grids[0].A = fineStencil(a, grid.dx(), grid.dy());
+        for(int d = 1; d <= depth; d++)
+        {
+            int ci = coarseningRatio(levels[d-1].m(), levels[d].m());
+            int cj = coarseningRatio(levels[d-1].n(), levels[d].n());
+            if (params.coarseop == GalerkinOperator)
+                Grids[d].A = galerkinStencil(Grids[d-1].A, levels[d].m(), levels[d].n(), ci, cj);
+            else
+                Grids[d].A = harmonicStencil(Grids[d-1].A, levels[d].m(), levels[d].n(), ci, cj);
+        }
+    }
+    // In a masked domain the points whose four neighbours are in the domain as well have an
+    // equation.  A coarse point has one when it interpolates to an active point of the finer
+    // level, so the coarse levels cover the domain up to its edge, and its operator is the
+    // Galerkin operator.
+    if (grid.MaskDefined())
+    {
+        DTCharArray domain = grid.Mask().MaskArray();
+        DTMutableCharArray inside(grid.m(), grid.n());
+        inside = 0;
+        for(int j = 1; j < grid.n()-1; j++)
+            for(int i = 1; i < grid.m()-1; i++)
+                inside(i, j) = domain(i, j) && domain(i-1, j) && domain(i+1, j) && domain(i, j-1) && domain(i, j+1);
+        setActive(Grids[0], inside);
+        for(int d = 1; d <= depth; d++)
+        {
+            int ci = coarseningRatio(levels[d-1].m(), levels[d].m());
+            int cj = coarseningRatio(levels[d-1].n(), levels[d].n());
+            DTCharArray fine = inside;
+            inside = DTMutableCharArray(levels[d].m(), levels[d].n());
+            inside = 0;
+            for(int J = 1; J < inside.n()-1; J++)
+                for(int I = 1; I < inside.m()-1; I++)
+                    for(int b = 1 - cj; b <= cj - 1; b++)
+                        for(int a = 1 - ci; a <= ci - 1; a++)
+                            if (fine(ci*I + a, cj*J + b))
+                                inside(I, J) = 1;
+            Grids[d].A = maskedStencil(Grids[d-1], inside, ci, cj);
+            setActive(Grids[d], inside);
+        }
+    }
+    const DTMesh2DGrid &coarsest = levels.back();
+    double rCoarsest = (coarsest.dx() * coarsest.dx()) / (coarsest.dy() * coarsest.dy());
+    if (!a.IsEmpty())
+        coarse.Factor(Grids[depth].A);
+    else if (grid.MaskDefined())
+        coarse.Factor(Grids[depth].active, coarsest.m(), coarsest.n(), rCoarsest, Grids[depth].A);
+    else
+        coarse.Factor(coarsest.m(), coarsest.n(), rCoarsest, params.sineCoarse, edges);
+    if (params.mixed)
+        levelTimes = DTMutableDoubleArray(depth+1);
+    if (params.fas)
+    {
+        restricted.resize(depth + 1);
+        for(int d = 1; d <= depth; d++)
+            restricted[d] = DTMutableDoubleArray(levels[d].m(), levels[d].n());
+        levelTimes = DTMutableDoubleArray(depth+1);
+    }
+    if (params.mgcg)
+    {
+        DTMutableDoubleArray zero(grid.m(), grid.n());
+        zero = 0;
+        x = zero.Copy();
+        p = zero.Copy();
+        q = zero;
+        columnSums = DTMutableDoubleArray(grid.n());
+        levelTimes = DTMutableDoubleArray(depth+1);
+    }
+    ExecutionSettings exec = solverExecution(params, team);
+    for(size_t d = 0; d < Grids.size(); d++)
+        Grids[d].exec = exec;
+    for(size_t d = 0; d < FloatGrids.size(); d++)
+        FloatGrids[d].exec = exec;
+}
+
+MGOutputs MultigridSolver::Solve(const DTDoubleArray &f, DTMutableDoubleArray &u, bool pureJacobi)
+{
+    if (Grids.empty() || f.m() != Grids[0].f.m() || f.n() != Grids[0].f.n() || u.m() != f.m() || u.n() != f.n())
+    {
+        printf("Error: Solve() called with arrays that do not match the grid of Setup()!\n");
+        exit(1);
+    }
+    if (params.mgcg && !pureJacobi)
+        return SolveCG(f, u);
+    if (params.mixed && !pureJacobi)
+        return SolveMixed(f, u);
+    if (params.fas && !pureJacobi)
+        return SolveFAS(f, u);
+
+    auto fine = Grids[0].f.DoubleData();
+    auto v = Grids[0].v.DoubleData();
+    CopyValues(fine, f);
+    CopyValues(v, u);
+    if (params.fmg)
+    {
+        // The full multigrid pass builds the solution from scratch, only the boundary is kept
+        if (Grids[0].active.NotEmpty())
+        {
+            double *ptr = v.Pointer();
+            forActive(Grids[0], 1, u.n()-1, [=](int k) {ptr[k] = 0;});
+        }
+        else
+        {
+            for(int j = 1; j < u.n()-1; j++)
+                for(int i = 1; i < u.m()-1; i++)
+                    v(i, j) = 0;
+        }
+    }
+    CopyValues(Grids[0].w, v);   // carries the Dirichlet boundary of the fine grid
+
+    MGOutputs output = runCycles(Grids.data(), depth, params, coarse, pureJacobi);
+    CopyValues(u, Grids[0].v.DoubleData());    // relax() may have swapped the solution into the scratch buffer
+    return output;
+}
+
+// Up to params.Nv FAS cycles, the first one a full multigrid pass if requested, until the
+// nonlinear residual meets the tolerance.
+MGOutputs MultigridSolver::SolveFAS(const DTDoubleArray &f, DTMutableDoubleArray &u)
+{
+    auto fine = Grids[0].f.DoubleData();
+    auto v = Grids[0].v.DoubleData();
+    CopyValues(fine, f);
+    CopyValues(v, u);
+    if (params.fmg)
+    {
+        for(int j = 1; j < u.n()-1; j++)
+            for(int i = 1; i < u.m()-1; i++)
+                v(i, j) = 0;
+    }
+    CopyValues(Grids[0].w, v);
+
+    int Nv = params.Nv;
+    DTMutableDoubleArray resnorm(Nv+1);
+    DTMutableDoubleArray times(Nv+1);
+    levelTimes = 0;
+    resnorm(0) = nonlinearResidualNorm(Grids[0], params.lambda);
+    times(0) = 0;
+    int done = 0;
+    while (done < Nv)
+    {
+        double time_singleV;
+        if (params.fmg && done == 0)
+            time_singleV = fasFullMultiGrid(Grids.data(), restricted.data(), depth, params, coarse, levelTimes);
+        else
+            time_singleV = fascycle(Grids.data(), restricted.data(), 0, depth, params, params.cycle, coarse, levelTimes);
+        times(done+1) = times(done) + time_singleV;
+        resnorm(done+1) = nonlinearResidualNorm(Grids[0], params.lambda);
+        done++;
+        if (resnorm(done) <= params.atol || resnorm(done) <= params.rtol * resnorm(0))
+            break;
+    }
+    if (done < Nv)
+    {
+        resnorm = TruncateSize(resnorm, done+1);
+        times = TruncateSize(times, done+1);
+    }
+    CopyValues(u, Grids[0].v.DoubleData());
+    return MGOutputs(resnorm, times, levelTimes.Copy());
+}
+
+double MultigridSolver::sumColumns() const
+{
+    double sum = 0;
+    for(int j = 1; j < columnSums.Length()-1; j++)
+        sum += columnSums(j);
+    return sum;
+}
+
+// z = one V cycle for A z = r from a zero initial guess, with r in Grids[0].f and z returned in
+// Grids[0].v.  The cycle is symmetric, so it can serve as the preconditioner of CG.
+void MultigridSolver::precondition()
+{
+    Grids[0].v = 0;     // the boundary of the scratch buffer is zeroed in SolveCG()
+    mgcycle(Grids.data(), 0, depth, params, VCycle, coarse, levelTimes);
+}
+
+// Preconditioned conjugate gradients for the interior unknowns, Grids[0].f holds the residual
+// r and the V cycle overwrites Grids[0].v with z.  The discrete Laplacian is negative definite,
+// which leaves every step of CG unchanged.  Each iteration applies the fine grid operator once
+// and does one V cycle.
+MGOutputs MultigridSolver::SolveCG(const DTDoubleArray &f, DTMutableDoubleArray &u)
+{
+    int M = f.m();
+    int N = f.n();
+    double dx = Grids[0].v.Grid().dx();
+    double dy = Grids[0].v.Grid().dy();
+    double h2 = dx * dx;
+    double invh2 = 1.0 / h2;
+    double cx = 1.0 / (dx * dx);
+    double cy = 1.0 / (dy * dy);
+    bool isotropic = (dx == dy);
+    bool variable = !Grids[0].A.W.IsEmpty();
+    const double *ptr_W = Grids[0].A.W.Pointer();
+    const double *ptr_S = Grids[0].A.S.Pointer();
+    const double *ptr_fin = f.Pointer();
+    double *ptr_x = x.Pointer();
+    double *ptr_p = p.Pointer();
+    double *ptr_q = q.Pointer();
+    double *ptr_sums = columnSums.Pointer();
+    double *ptr_r = Grids[0].f.DoubleData().Pointer();
+
+    int Nv = params.Nv;
+    DTMutableDoubleArray resnorm(Nv+1);
+    DTMutableDoubleArray times(Nv+1);
+    levelTimes = 0;
+    DTTimer timer;
+
+    // r = f - A x
+    CopyValues(x, u);
+    Grids[0].w = 0;
+    std::atomic<double> norm(0.0);
+    parallelColumns(Grids[0].exec, M, 1, N-1, [&](int j0, int j1) {
+        double local = 0;
+        for(int j = j0; j < j1; j++)
+        {
+            for(int i = 1; i < M-1; i++)
+            {
+                double res;
+                if (variable)
+                    res = pointResidual(ptr_x, ptr_fin, ptr_W, ptr_S, M, i, j);
+                else
+                    res = isotropic ? pointResidual(ptr_x, ptr_fin, M, i, j, invh2) : pointResidual(ptr_x, ptr_fin, M, i, j, cx, cy);
+                *(ptr_r + i + j*M) = res;
+                local = std::max(local, std::fabs(res));
+            }
+        }
+        double current = norm.load();
+        while (local > current && !norm.compare_exchange_weak(current, local));
+    });
+    resnorm(0) = norm.load();
+    times(0) = 0;
+
+    // p = z, rho = r.z
+    timer.Start();
+    precondition();
+    const double *ptr_z = Grids[0].v.DoubleData().Pointer();
+    parallelColumns(Grids[0].exec, M, 1, N-1, [=](int j0, int j1) {
+        for(int j = j0; j < j1; j++)
+        {
+            double sum = 0;
+            for(int i = 1; i < M-1; i++)
+            {
+                *(ptr_p + i + j*M) = *(ptr_z + i + j*M);
+                sum += *(ptr_r + i + j*M) * *(ptr_z + i + j*M);
+            }
+            ptr_sums[j] = sum;
+        }
+    });
+    double rho = sumColumns();
+    double elapsed = timer.Stop();
+
+    int done = 0;
+    while (done < Nv)
+    {
+        timer.Start();
+        // q = A p, alpha = rho / p.q
+        parallelColumns(Grids[0].exec, M, 1, N-1, [=](int j0, int j1) {
+            for(int j = j0; j < j1; j++)
+            {
+                double sum = 0;
+                for(int i = 1; i < M-1; i++)
+                {
+                    const double *pc = ptr_p + i + j*M;
+                    double Ap;
+                    if (variable)
+                    {
+                        const double *W = ptr_W + i + j*M;
+                        const double *S = ptr_S + i + j*M;
+                        Ap = W[0] * (pc[-1] - pc[0]) + W[1] * (pc[1] - pc[0]) + S[0] * (pc[-M] - pc[0]) + S[M] * (pc[M] - pc[0]);
+                    }
+                    else
+                    {
+                        Ap = isotropic ? (pc[-1] + pc[1] + pc[-M] + pc[M] - pc[0] * 4.0) * invh2
+                                       : cx * (pc[-1] + pc[1] - 2.0 * pc[0]) + cy * (pc[-M] + pc[M] - 2.0 * pc[0]);
+                    }
+                    *(ptr_q + i + j*M) = Ap;
+                    sum += *(ptr_p + i + j*M) * Ap;
+                }
+                ptr_sums[j] = sum;
+            }
+        });
+        double alpha = rho / sumColumns();
+
+        // x += alpha p, r -= alpha q
+        norm = 0.0;
+        parallelColumns(Grids[0].exec, M, 1, N-1, [&](int j0, int j1) {
+            double local = 0;
+            for(int j = j0; j < j1; j++)
+            {
+                for(int i = 1; i < M-1; i++)
+                {
+                    *(ptr_x + i + j*M) += alpha * *(ptr_p + i + j*M);
+                    double res = *(ptr_r + i + j*M) - alpha * *(ptr_q + i + j*M);
+                    *(ptr_r + i + j*M) = res;
+                    local = std::max(local, std::fabs(res));
+                }
+            }
+            double current = norm.load();
+            while (local > current && !norm.compare_exchange_weak(current, local));
+        });
+        done++;
+        resnorm(done) = norm.load();
+        if (resnorm(done) <= params.atol || resnorm(done) <= params.rtol * resnorm(0) || done == Nv)
+        {
+            times(done) = times(done-1) + elapsed + timer.Stop();
+            elapsed = 0;
+            break;
+        }
+
+        // z = V(r), beta = r.z / rho, p = z + beta p
+        precondition();
+        ptr_z = Grids[0].v.DoubleData().Pointer();    // the Jacobi smoother may have swapped v and w
+        parallelColumns(Grids[0].exec, M, 1, N-1, [=](int j0, int j1) {
+            for(int j = j0; j < j1; j++)
+            {
+                double sum = 0;
+                for(int i = 1; i < M-1; i++)
+                    sum += *(ptr_r + i + j*M) * *(ptr_z + i + j*M);
+                ptr_sums[j] = sum;
+            }
+        });
+        double rhoNew = sumColumns();
+        double beta = rhoNew / rho;
+        rho = rhoNew;
+        parallelColumns(Grids[0].exec, M, 1, N-1, [=](int j0, int j1) {
+            for(int j = j0; j < j1; j++)
+                for(int i = 1; i < M-1; i++)
+                    *(ptr_p + i + j*M) = *(ptr_z + i + j*M) + beta * *(ptr_p + i + j*M);
+        });
+        times(done) = times(done-1) + elapsed + timer.Stop();
+        elapsed = 0;
+    }
+    if (done < Nv)
+    {
+        resnorm = TruncateSize(resnorm, done+1);
+        times = TruncateSize(times, done+1);
+    }
+    CopyValues(u, x);
+    return MGOutputs(resnorm, times, levelTimes.Copy());
+}
+
+// Iterative refinement: the residual of the double precision solution is rounded to single
+// precision, a single precision cycle on FloatGrids approximately solves for the correction with
+// zero boundary values, and the correction is added to the solution in double.  The cycles move
+// half the bytes, while the accuracy of the solution is set by the double residual.
+MGOutputs MultigridSolver::SolveMixed(const DTDoubleArray &f, DTMutableDoubleArray &u)
+{
+    int M = f.m();
+    int N = f.n();
+    double h2 = Grids[0].v.Grid().dx() * Grids[0].v.Grid().dx();
+    double invh2 = 1.0 / h2;
+    auto xData = Grids[0].v.DoubleData();
+    CopyValues(xData, u);
+    double *ptr_x = xData.Pointer();
+    const double *ptr_f = f.Pointer();
+    floatgridtype &fine = FloatGrids[0];
+
+    // r = f - A x, rounded into the right hand side of the single precision hierarchy
+    float *ptr_r = fine.f.Pointer();
+    auto updateResidual = [&]() {
+        std::atomic<double> norm(0.0);
+        parallelColumns(Grids[0].exec, M, 1, N-1, [&](int j0, int j1) {
+            double local = 0;
+            for(int j = j0; j < j1; j++)
+            {
+                for(int i = 1; i < M-1; i++)
+                {
+                    double res = pointResidual(ptr_x, ptr_f, M, i, j, invh2);
+                    *(ptr_r + i + j*M) = float(res);
+                    local = std::max(local, std::fabs(res));
+                }
+            }
+            double current = norm.load();
+            while (local > current && !norm.compare_exchange_weak(current, local));
+        });
+        return norm.load();
+    };
+
+    int Nv = params.Nv;
+    DTMutableDoubleArray resnorm(Nv+1);
+    DTMutableDoubleArray times(Nv+1);
+    levelTimes = 0;
+    for(int d = 0; d <= depth; d++)
+    {
+        FloatGrids[d].v = 0;
+        FloatGrids[d].w = 0;
+    }
+    resnorm(0) = updateResidual();
+    times(0) = 0;
+    DTTimer timer;
+    int done = 0;
+    while (done < Nv)
+    {
+        timer.Start();
+        fine.v = 0;
+        if (params.fmg && done == 0)
+            fullMultiGrid(FloatGrids.data(), depth, params, coarse, levelTimes);
+        else
+            mgcycle(FloatGrids.data(), 0, depth, params, params.cycle, coarse, levelTimes);
+
+        // x += e
+        const float *ptr_e = fine.v.Pointer();
+        parallelColumns(Grids[0].exec, M, 1, N-1, [=](int j0, int j1) {
+            for(int j = j0; j < j1; j++)
+                for(int i = 1; i < M-1; i++)
+                    *(ptr_x + i + j*M) += *(ptr_e + i + j*M);
+        });
+        resnorm(done+1) = updateResidual();
+        times(done+1) = times(done) + timer.Stop();
+        done++;
+        if (resnorm(done) <= params.atol || resnorm(done) <= params.rtol * resnorm(0))
+            break;
+    }
+    if (done < Nv)
+    {
+        resnorm = TruncateSize(resnorm, done+1);
+        times = TruncateSize(times, done+1);
+    }
+    CopyValues(u, xData);
+    return MGOutputs(resnorm, times, levelTimes.Copy());
+}
+
+// Same as MultigridSolver, for K right hand sides on the same grid that are solved together
+// in the interleaved layout of batchedgridtype.  The arrays passed to Solve() are M x N x K.
+class BatchedMultigridSolver
+{
+public:
+    explicit BatchedMultigridSolver(const MGParameters &_params) : params(_params), depth(0) {}
+
+    void Setup(const DTMesh2DGrid &grid, int K);
+    MGOutputs Solve(const DTDoubleArray &f, DTMutableDoubleArray &u);
+
+private:
+    MGParameters params;
+    int depth;
+    std::vector<batchedgridtype> Grids;
+    CoarseSolver coarse;
+    std::unique_ptr<ThreadTeam> team;
+};
+
+void BatchedMultigridSolver::Setup(const DTMesh2DGrid &grid, int K)
+{
+    std::vector<DTMesh2DGrid> levels = levelGrids(grid, params.coarsest, FullCoarsening, true);
+    depth = int(levels.size()) - 1;
+    Grids.assign(depth + 1, batchedgridtype());
+
+    edgetype edges;
+    for(int d = 0; d <= depth; d++)
+    {
+        const DTMesh2DGrid &levelGrid = levels[d];
+        if (d > 0)
+            edges = coarseEdges(edges, levels[d-1], levelGrid);
+        DTMutableDoubleArray dData(K, levelGrid.m(), levelGrid.n());
+        dData = 0;
+        Grids[d].grid = levelGrid;
+        Grids[d].f = dData.Copy();
+        Grids[d].v = dData.Copy();
+        Grids[d].w = dData;
+        Grids[d].edges = edges;
+        if (hasEdges(edges))
+            Grids[d].edgeScratch = DTMutableDoubleArray(K, levelGrid.m() + levelGrid.n());
+    }
+    coarse.Factor(Grids[depth].v.n(), Grids[depth].v.o(), 1.0, params.sineCoarse, edges);
+    ExecutionSettings exec = solverExecution(params, team);
+    for(size_t d = 0; d < Grids.size(); d++)
+        Grids[d].exec = exec;
+}
+
+MGOutputs BatchedMultigridSolver::Solve(const DTDoubleArray &f, DTMutableDoubleArray &u)
+{
+    if (Grids.empty() || f.m() != Grids[0].f.n() || f.n() != Grids[0].f.o() || f.o() != Grids[0].f.m() ||
+        u.m() != f.m() || u.n() != f.n() || u.o() != f.o())
+    {
+        printf("Error: Solve() called with arrays that do not match the grid of Setup()!\n");
+        exit(1);
+    }
+
+    int M = f.m();
+    int N = f.n();
+    int K = f.o();
+    batchedgridtype &fine = Grids[0];
+    for(int j = 0; j < N; j++)
+    {
+        for(int i = 0; i < M; i++)
+        {
+            bool interior = (i > 0 && i < M-1 && j > 0 && j < N-1);
+            for(int r = 0; r < K; r++)
+            {
+                fine.f(r, i, j) = f(i, j, r);
+                fine.v(r, i, j) = (params.fmg && interior) ? 0.0 : u(i, j, r);
+            }
+        }
+    }
+    CopyValues(fine.w, fine.v);
+
+    MGOutputs output = runCycles(Grids.data(), depth, params, coarse, false);
+    for(int r = 0; r < K; r++)
+        for(int j = 0; j < N; j++)
+            for(int i = 0; i < M; i++)
+                u(i, j, r) = fine.v(r, i, j);
+    return output;
+}
+
+
+// The 3D problem.  Every level is a grid of cubes of side h, fully coarsened, with the 7-point
+// stencil.  The sweeps over an M x N x O level are split into blocks of rows j so the planes
+// k-1, k and k+1 of a block that the stencil reads stay in cache while the block moves up
+// through the planes, and the threads take contiguous ranges of planes k.
+
+// Rows of a j block, the three planes of u that are read and the plane that is written fit
+// in cacheBytes, see BlockingSettings.
+int rowsPerBlock3D(int M, int cacheBytes)
+{
+    return std::max(1, cacheBytes / int(4 * sizeof(double) * M));
+}
+
+// Calls row(j, k) for the interior rows of the planes [k0, k1) one j block at a time
+template <class Row>
+inline void blockedRows3D(int M, int N, int k0, int k1, int cacheBytes, const Row &row)
+{
+    int rows = rowsPerBlock3D(M, cacheBytes);
+    for(int jb = 1; jb < N-1; jb += rows)
+    {
+        int je = std::min(N-1, jb + rows);
+        for(int k = k0; k < k1; k++)
+            for(int j = jb; j < je; j++)
+                row(j, k);
+    }
+}
+
+void jacobi3D(const double *ptr, double *ptr_new, const double *ptr_f, int M, int N, int k0, int k1, double h2, double omega, int cacheBytes)
+{
+    int MN = M*N;
+    double nomega = 1 - omega;
+    double factor = omega / 6.0;
+    blockedRows3D(M, N, k0, k1, cacheBytes, [=](int j, int k) {
+        const double *u = ptr + j*M + k*MN;
+        const double *f = ptr_f + j*M + k*MN;
+        double *unew = ptr_new + j*M + k*MN;
+        for(int i = 1; i < M-1; i++)
+            unew[i] = u[i] * nomega + (u[i-1] + u[i+1] + u[i-M] + u[i+M] + u[i-MN] + u[i+MN] - f[i]*h2) * factor;
+    });
+}
+
+void redBlackSweep3D(double *ptr, const double *ptr_f, int M, int N, int k0, int k1, double h2, double omega, int colour, int cacheBytes)
+{
+    // Updates the points with (i+j+k)%2 == colour, their neighbours all have the other colour.
+    int MN = M*N;
+    double nomega = 1 - omega;
+    double factor = omega / 6.0;
+    blockedRows3D(M, N, k0, k1, cacheBytes, [=](int j, int k) {
+        double *u = ptr + j*M + k*MN;
+        const double *f = ptr_f + j*M + k*MN;
+        for(int i = 2 - (j + k + colour) % 2; i < M-1; i += 2)
+            u[i] = u[i] * nomega + (u[i-1] + u[i+1] + u[i-M] + u[i+M] + u[i-MN] + u[i+MN] - f[i]*h2) * factor;
+    });
+}
+
+void relax(grid3Dtype &p, int Niter, double omega, SmootherType smoother, bool reverse = false)
+{
+    int M = p.v.m();
+    int N = p.v.n();
+    int O = p.v.o();
+    double h2 = p.h * p.h;
+    double *ptr = p.v.Pointer();
+    double *ptr_new = p.w.Pointer();
+    const double *ptr_f = p.f.Pointer();
+    int cacheBytes = p.exec.blocking.cacheBytes;
+    if (smoother == JacobiSmoother)
+    {
+        parallelSweeps(p.exec, M, 1, O-1, Niter, [=](int iter, int k0, int k1) {
+            if (iter % 2 == 0)
+                jacobi3D(ptr, ptr_new, ptr_f, M, N, k0, k1, h2, omega, cacheBytes);
+            else
+                jacobi3D(ptr_new, ptr, ptr_f, M, N, k0, k1, h2, omega, cacheBytes);
+        });
+        if (Niter % 2 == 1)
+            std::swap(p.v, p.w);
+    }
+    else
+    {
+        if (smoother == GaussSeidelSmoother) omega = 1.0;
+        int firstColour = reverse ? 1 : 0;
+        parallelSweeps(p.exec, M, 1, O-1, 2 * Niter, [=](int sweep, int k0, int k1) {
+            redBlackSweep3D(ptr, ptr_f, M, N, k0, k1, h2, omega, (sweep + firstColour) % 2, cacheBytes);
+        });
+    }
+}
+
+inline double pointResidual3D(const double *u, const double *f, int M, int MN, double invh2)
+{
+    return *f - (u[-1] + u[1] + u[-M] + u[M] + u[-MN] + u[MN] - u[0] * 6.0) * invh2;
+}
+
+// 27-point full weighting of the interior of fine onto the coarse planes [K0, K1).  The nine
+// fine rows around a coarse row are first weighted in j and k into line, which is then
+// weighted in i.
+void fullWeighting3D(const double *fine, double *coarse, int M, int N, int Mc, int Nc, int K0, int K1)
+{
+    const double w[3] = {0.25, 0.5, 0.25};
+    int MN = M*N;
+    std::vector<double> line(M);
+    for(int K = K0; K < K1; K++)
+    {
+        for(int J = 1; J < Nc-1; J++)
+        {
+            for(int i = 1; i < M-1; i++)
+                line[i] = 0;
+            for(int dk = -1; dk <= 1; dk++)
+            {
+                for(int dj = -1; dj <= 1; dj++)
+                {
+                    const double *row = fine + (2*J+dj)*M + (2*K+dk)*MN;
+                    double weight = w[dj+1] * w[dk+1];
+                    for(int i = 1; i < M-1; i++)
+                        line[i] += weight * row[i];
+                }
+            }
+            double *c = coarse + J*Mc + K*Mc*Nc;
+            for(int I = 1; I < Mc-1; I++)
+                c[I] = w[0] * line[2*I-1] + w[1] * line[2*I] + w[2] * line[2*I+1];
+        }
+    }
+}
+
+// The residual goes to the interior of the scratch buffer, which is free after relax(), and
+// is then restricted by full weighting.
+void restrictResidual(grid3Dtype &p, grid3Dtype &coarse)
+{
+    int M = p.v.m();
+    int N = p.v.n();
+    int O = p.v.o();
+    int Mc = coarse.f.m();
+    int Nc = coarse.f.n();
+    int Oc = coarse.f.o();
+    assert(Mc == (M - 1) / 2 + 1 && Nc == (N - 1) / 2 + 1 && Oc == (O - 1) / 2 + 1);
+    double invh2 = 1.0 / (p.h * p.h);
+    int MN = M*N;
+    const double *ptr = p.v.Pointer();
+    const double *ptr_f = p.f.Pointer();
+    double *ptr_res = p.w.Pointer();
+    double *ptr_c = coarse.f.Pointer();
+    int cacheBytes = p.exec.blocking.cacheBytes;
+    parallelColumns(p.exec, M, 1, O-1, [=](int k0, int k1) {
+        blockedRows3D(M, N, k0, k1, cacheBytes, [=](int j, int k) {
+            int offset = j*M + k*MN;
+            for(int i = 1; i < M-1; i++)
+                ptr_res[offset + i] = pointResidual3D(ptr + offset + i, ptr_f + offset + i, M, MN, invh2);
+        });
+    });
+    parallelColumns(p.exec, Mc, 1, Oc-1, [=](int K0, int K1) {
+        fullWeighting3D(ptr_res, ptr_c, M, N, Mc, Nc, K0, K1);
+    });
+}
+
+void restrictRHS(const grid3Dtype &fine, grid3Dtype &coarse)
+{
+    int M = fine.f.m();
+    int N = fine.f.n();
+    int Mc = coarse.f.m();
+    int Nc = coarse.f.n();
+    const double *ptr_f = fine.f.Pointer();
+    double *ptr_c = coarse.f.Pointer();
+    parallelColumns(fine.exec, Mc, 1, coarse.f.o()-1, [=](int K0, int K1) {
+        fullWeighting3D(ptr_f, ptr_c, M, N, Mc, Nc, K0, K1);
+    });
+}
+
+// Trilinear interpolation of the coarse correction added to the interior of p.v.  For every
+// fine row the one, two or four coarse rows around it are averaged into line, which is then
+// interpolated linearly in i.
+void interpolateCorrection(const grid3Dtype &coarse, grid3Dtype &p)
+{
+    int M = p.v.m();
+    int N = p.v.n();
+    int O = p.v.o();
+    int Mc = coarse.v.m();
+    int Nc = coarse.v.n();
+    assert(Mc == (M - 1) / 2 + 1 && Nc == (N - 1) / 2 + 1 && coarse.v.o() == (O - 1) / 2 + 1);
+    int MNc = Mc*Nc;
+    const double *ptr_c = coarse.v.Pointer();
+    double *ptr = p.v.Pointer();
+    parallelColumns(p.exec, M, 1, O-1, [=](int k0, int k1) {
+        std::vector<double> line(Mc);
+        for(int k = k0; k < k1; k++)
+        {
+            for(int j = 1; j < N-1; j++)
+            {
+                const double *c00 = ptr_c + (j/2)*Mc + (k/2)*MNc;
+                const double *c01 = (j % 2) ? c00 + Mc : c00;
+                const double *c10 = (k % 2) ? c00 + MNc : c00;
+                const double *c11 = (k % 2) ? c01 + MNc : c01;
+                for(int I = 0; I < Mc; I++)
+                    line[I] = 0.25 * (c00[I] + c01[I] + c10[I] + c11[I]);
+                double *out = ptr + j*M + k*M*N;
+                for(int I = 0; I < Mc-1; I++)
+                {
+                    if (I > 0) out[2*I] += line[I];
+                    out[2*I+1] += 0.5 * (line[I] + line[I+1]);
+                }
+            }
+        }
+    });
+}
+
+double residualNorm(const grid3Dtype &p)
+{
+    int M = p.v.m();
+    int N = p.v.n();
+    int O = p.v.o();
+    double invh2 = 1.0 / (p.h * p.h);
+    int MN = M*N;
+    const double *ptr = p.v.Pointer();
+    const double *ptr_f = p.f.Pointer();
+    std::atomic<double> norm(0.0);
+    parallelColumns(p.exec, M, 1, O-1, [&](int k0, int k1) {
+        double local = 0;
+        blockedRows3D(M, N, k0, k1, p.exec.blocking.cacheBytes, [&](int j, int k) {
+            int offset = j*M + k*MN;
+            for(int i = 1; i < M-1; i++)
+                local = std::max(local, std::fabs(pointResidual3D(ptr + offset + i, ptr_f + offset + i, M, MN, invh2)));
+        });
+        double current = norm.load();
+        while (local > current && !norm.compare_exchange_weak(current, local));
+    });
+    return norm.load();
+}
+
+// Copies the six faces of the fine solution onto the coarse solution and its scratch buffer.
+void injectBoundary(const grid3Dtype &fine, grid3Dtype &coarse)
+{
+    int Mc = coarse.v.m();
+    int Nc = coarse.v.n();
+    int Oc = coarse.v.o();
+    for(int K = 0; K < Oc; K++)
+    {
+        for(int J = 0; J < Nc; J++)
+        {
+            for(int I = 0; I < Mc; I++)
+            {
+                if (I > 0 && I < Mc-1 && J > 0 && J < Nc-1 && K > 0 && K < Oc-1) continue;
+                coarse.v(I, J, K) = coarse.w(I, J, K) = fine.v(2*I, 2*J, 2*K);
+            }
+        }
+    }
+}
+
+// The 7-point stencil -h^2 * Laplacian on the interior points of an MxNxO grid, numbered
+// i fastest and k slowest.
+SpMat laplacianMatrix3D(int M, int N, int O)
+{
+    int m = M-2, n = N-2, o = O-2;
+    std::vector<T> coefficients;
+    for(int k = 0; k < o; k++)
+    {
+        for(int j = 0; j < n; j++)
+        {
+            for(int i = 0; i < m; i++)
+            {
+                int row = i + j*m + k*m*n;
+                coefficients.push_back(T(row, row, 6.0));
+                if (i > 0) coefficients.push_back(T(row, row-1, -1.0));
+                if (i < m-1) coefficients.push_back(T(row, row+1, -1.0));
+                if (j > 0) coefficients.push_back(T(row, row-m, -1.0));
+                if (j < n-1) coefficients.push_back(T(row, row+m, -1.0));
+                if (k > 0) coefficients.push_back(T(row, row-m*n, -1.0));
+                if (k < o-1) coefficients.push_back(T(row, row+m*n, -1.0));
+            }
+        }
+    }
+    SpMat A(m*n*o, m*n*o);
+    A.setFromTriplets(coefficients.begin(), coefficients.end());
+    return A;
+}
+
+// Direct solver for the coarsest 3D level, factored once in Factor()
+class CoarseSolver3D
+{
+public:
+    CoarseSolver3D() : M(0), N(0), O(0) {}
+
+    void Factor(int m, int n, int o)
+    {
+        M = m;
+        N = n;
+        O = o;
+        chol.compute(laplacianMatrix3D(M, N, O));
+        if (chol.info() != Eigen::Success)
+        {
+            printf("Error: Factorization of the %dx%dx%d coarse grid failed!\n", M, N, O);
+            exit(1);
+        }
+        b.resize((M-2)*(N-2)*(O-2));
+        x.resize((M-2)*(N-2)*(O-2));
+    }
+
+    void Solve(grid3Dtype &p);
+
+private:
+    int M, N, O;
+    Eigen::SimplicialCholesky<SpMat> chol;
+    Eigen::VectorXd b, x;
+};
+
+void CoarseSolver3D::Solve(grid3Dtype &p)
+{
+    DTMutableDoubleArray &u = p.v;
+    assert(u.m() == M && u.n() == N && u.o() == O);
+    double h2 = p.h * p.h;
+
+    // Right hand side, with the Dirichlet values of the boundary moved over
+    int cnt = 0;
+    for(int k = 1; k < O-1; k++)
+    {
+        for(int j = 1; j < N-1; j++)
+        {
+            for(int i = 1; i < M-1; i++)
+            {
+                double rhs = -h2 * p.f(i, j, k);
+                if (i == 1) rhs += u(0, j, k);
+                if (i == M-2) rhs += u(M-1, j, k);
+                if (j == 1) rhs += u(i, 0, k);
+                if (j == N-2) rhs += u(i, N-1, k);
+                if (k == 1) rhs += u(i, j, 0);
+                if (k == O-2) rhs += u(i, j, O-1);
+                b[cnt++] = rhs;
+            }
+        }
+    }
+    x = chol.solve(b);
+    cnt = 0;
+    for(int k = 1; k < O-1; k++)
+        for(int j = 1; j < N-1; j++)
+            for(int i = 1; i < M-1; i++)
+                u(i, j, k) = x[cnt++];
+}
+
+// Same as MultigridSolver for an M x N x O grid of cubes of side h.  All three directions are
+// coarsened together, and the hierarchy ends when one of them can not be halved.
+class Multigrid3DSolver
+{
+public:
+    explicit Multigrid3DSolver(const MGParameters &_params) : params(_params), depth(0) {}
+
+    void Setup(int m, int n, int o, double h);
+    MGOutputs Solve(const DTDoubleArray &f, DTMutableDoubleArray &u);
+
+private:
+    MGParameters params;
+    int depth;
+    std::vector<grid3Dtype> Grids;
+    CoarseSolver3D coarse;
+    std::unique_ptr<ThreadTeam> team;
+};
+
+void Multigrid3DSolver::Setup(int m, int n, int o, double h)
+{
+    Grids.assign(1, grid3Dtype());
+    while (true)
+    {
+        if (Grids.size() > 1)
+        {
+            const grid3Dtype &finer = Grids[Grids.size()-2];
+            m = (finer.f.m() - 1) / 2 + 1;
+            n = (finer.f.n() - 1) / 2 + 1;
+            o = (finer.f.o() - 1) / 2 + 1;
+            h = finer.h * 2.0;
+        }
+        DTMutableDoubleArray dData(m, n, o);
+        dData = 0;
+        grid3Dtype &level = Grids.back();
+        level.h = h;
+        level.f = dData.Copy();
+        level.v = dData.Copy();
+        level.w = dData;
+        if (!canCoarsen(m, params.coarsest) || !canCoarsen(n, params.coarsest) || !canCoarsen(o, params.coarsest))
+            break;
+        Grids.push_back(grid3Dtype());
+    }
+    checkCoarsest({m, n, o}, params.coarsest);
+    depth = int(Grids.size()) - 1;
+    coarse.Factor(Grids[depth].v.m(), Grids[depth].v.n(), Grids[depth].v.o());
+    ExecutionSettings exec = solverExecution(params, team);
+    for(size_t d = 0; d < Grids.size(); d++)
+        Grids[d].exec = exec;
+}
+
+MGOutputs Multigrid3DSolver::Solve(const DTDoubleArray &f, DTMutableDoubleArray &u)
+{
+    if (Grids.empty() || f.m() != Grids[0].f.m() || f.n() != Grids[0].f.n() || f.o() != Grids[0].f.o() ||
+        u.m() != f.m() || u.n() != f.n() || u.o() != f.o())
+    {
+        printf("Error: Solve() called with arrays that do not match the grid of Setup()!\n");
+        exit(1);
+    }
+
+    grid3Dtype &fine = Grids[0];
+    CopyValues(fine.f, f);
+    CopyValues(fine.v, u);
+    if (params.fmg)
+    {
+        // The full multigrid pass builds the solution from scratch, only the boundary is kept
+        for(int k = 1; k < u.o()-1; k++)
+            for(int j = 1; j < u.n()-1; j++)
+                for(int i = 1; i < u.m()-1; i++)
+                    fine.v(i, j, k) = 0;
+    }
+    CopyValues(fine.w, fine.v);
+
+    MGOutputs output = runCycles(Grids.data(), depth, params, coarse, false);
+    CopyValues(u, fine.v);
+    return output;
+}
+
+// Neumann and periodic boundaries.  Before every sweep the halo is refilled from the unknowns,
+// mirrored across the edge for a zero normal derivative and wrapped around for periodic
+// boundaries, and then the points are updated with the usual anisotropic kernels.  Both problems
+// are singular, the constants solve the homogeneous problem.  f is made compatible once, the
+// coarsest level projects the constants out of its right hand side, and the solution is
+// returned with a zero (weighted) mean.
+
+// The unknown a halo index stands for
+inline int haloSource(int i, int L, BoundaryType bc)
+{
+    if (bc == PeriodicBoundary)
+        return (i == 0) ? L : ((i > L) ? i - L : i);
+    return (i == 0) ? 2 : ((i > L) ? 2*L - i : i);
+}
+
+void fillHalo(const halogridtype &p, DTMutableDoubleArray &a)
+{
+    int M = a.m();
+    int N = a.n();
+    for(int j = 1; j <= p.Ly; j++)
+        for(int i = 0; i < M; i++)
+            if (i == 0 || i > p.Lx)
+                a(i, j) = a(haloSource(i, p.Lx, p.bc), j);
+    for(int j = 0; j < N; j++)
+        if (j == 0 || j > p.Ly)
+            for(int i = 0; i < M; i++)
+                a(i, j) = a(i, haloSource(j, p.Ly, p.bc));
+}
+
+void relax(halogridtype &p, int Niter, double omega, SmootherType smoother, bool reverse = false)
+{
+    int M = p.v.m();
+    double cx = 1.0 / (p.dx * p.dx);
+    double cy = 1.0 / (p.dy * p.dy);
+    const double *ptr_f = p.f.Pointer();
+    if (smoother == JacobiSmoother)
+    {
+        for(int iter = 0; iter < Niter; iter++)
+        {
+            fillHalo(p, p.v);
+            const double *ptr = p.v.Pointer();
+            double *ptr_new = p.w.Pointer();
+            parallelColumns(p.exec, M, 1, p.Ly + 1, [=](int j0, int j1) {
+                jacobiAnisotropic(ptr, ptr_new, ptr_f, M, j0, j1, cx, cy, omega);
+            });
+            std::swap(p.v, p.w);
+        }
+        return;
+    }
+    if (smoother == GaussSeidelSmoother) omega = 1.0;
+    int firstColour = reverse ? 1 : 0;
+    double *ptr = p.v.Pointer();
+    for(int sweep = 0; sweep < 2 * Niter; sweep++)
+    {
+        fillHalo(p, p.v);
+        parallelColumns(p.exec, M, 1, p.Ly + 1, [=](int j0, int j1) {
+            redBlackSweepAnisotropic(ptr, ptr_f, M, j0, j1, cx, cy, omega, (sweep + firstColour) % 2);
+        });
+    }
+}
+
+// Full weighting in the directions that are coarsened and injection in the others, with the
+// residual or f of a halo point taken from the unknown it stands for
+template <class Value>
+void restrictHalo(const Value &value, const halogridtype &p, halogridtype &coarse)
+{
+    double *ptr_c = coarse.f.Pointer();
+    int Mc = coarse.f.m();
+    bool cx = coarse.Lx < p.Lx;
+    bool cy = coarse.Ly < p.Ly;
+    const double halved[3] = {0.25, 0.5, 0.25};
+    const double kept[3] = {0.0, 1.0, 0.0};
+    const double *wx = cx ? halved : kept;
+    const double *wy = cy ? halved : kept;
+    parallelColumns(p.exec, Mc, 1, coarse.Ly + 1, [&](int J0, int J1) {
+        for(int J = J0; J < J1; J++)
+        {
+            int j = cy ? 2*J - 1 : J;
+            for(int I = 1; I <= coarse.Lx; I++)
+            {
+                int i = cx ? 2*I - 1 : I;
+                double sum = 0;
+                for(int b = 0; b < 3; b++)
+                    for(int a = 0; a < 3; a++)
+                        if (wx[a] * wy[b] != 0.0)
+                            sum += wx[a] * wy[b] * value(haloSource(i+a-1, p.Lx, p.bc), haloSource(j+b-1, p.Ly, p.bc));
+                ptr_c[I + J*Mc] = sum;
+            }
+        }
+    });
+}
+
+void restrictResidual(halogridtype &p, halogridtype &coarse)
+{
+    fillHalo(p, p.v);
+    int M = p.v.m();
+    double cx = 1.0 / (p.dx * p.dx);
+    double cy = 1.0 / (p.dy * p.dy);
+    const double *ptr = p.v.Pointer();
+    const double *ptr_f = p.f.Pointer();
+    restrictHalo([=](int i, int j) {return pointResidual(ptr, ptr_f, M, i, j, cx, cy);}, p, coarse);
+}
+
+void restrictRHS(const halogridtype &fine, halogridtype &coarse)
+{
+    int M = fine.f.m();
+    const double *ptr_f = fine.f.Pointer();
+    restrictHalo([=](int i, int j) {return ptr_f[i + j*M];}, fine, coarse);
+}
+
+// Linear interpolation in the directions that are coarsened, the coarse halo supplies the
+// points past the last periodic unknown
+void interpolateCorrection(halogridtype &coarse, halogridtype &p)
+{
+    fillHalo(coarse, coarse.v);
+    int M = p.v.m();
+    int Mc = coarse.v.m();
+    const double *c = coarse.v.Pointer();
+    double *ptr = p.v.Pointer();
+    int Lx = p.Lx;
+    bool cx = coarse.Lx < p.Lx;
+    bool cy = coarse.Ly < p.Ly;
+    parallelColumns(p.exec, M, 1, p.Ly + 1, [=](int j0, int j1) {
+        for(int j = j0; j < j1; j++)
+        {
+            // Grid point j-1 is coarse point (j-1)/2, or halfway to the next one when odd
+            int J = cy ? (j - 1) / 2 + 1 : j;
+            const double *below = c + J * Mc;
+            const double *above = (cy && (j - 1) % 2 == 1) ? below + Mc : below;
+            for(int i = 1; i <= Lx; i++)
+            {
+                int I0 = cx ? (i - 1) / 2 + 1 : i;
+                int I1 = (cx && (i - 1) % 2 == 1) ? I0 + 1 : I0;
+                ptr[i + j*M] += 0.25 * (below[I0] + below[I1] + above[I0] + above[I1]);
+            }
+        }
+    });
+}
+
+double residualNorm(halogridtype &p)
+{
+    fillHalo(p, p.v);
+    int M = p.v.m();
+    double cx = 1.0 / (p.dx * p.dx);
+    double cy = 1.0 / (p.dy * p.dy);
+    const double *ptr = p.v.Pointer();
+    const double *ptr_f = p.f.Pointer();
+    std::atomic<double> norm(0.0);
+    parallelColumns(p.exec, M, 1, p.Ly + 1, [&](int j0, int j1) {
+        double local = 0;
+        for(int j = j0; j < j1; j++)
+            for(int i = 1; i <= p.Lx; i++)
+                local = std::max(local, std::fabs(pointResidual(ptr, ptr_f, M, i, j, cx, cy)));
+        double current = norm.load();
+        while (local > current && !norm.compare_exchange_weak(current, local));
+    });
+    return norm.load();
+}
+
+// There is no boundary to carry over
+void injectBoundary(const halogridtype &, halogridtype &)
+{
+}
+
+// The weight of an unknown in the compatibility condition sum(weight * f) = 0, which is also
+// the mean that is removed from the solution: 1 for periodic boundaries, and the trapezoidal
+// rule for Neumann boundaries, whose equations on the edges are the mirrored ones.
+inline double nullWeight(const halogridtype &p, int i, int j)
+{
+    if (p.bc == PeriodicBoundary) return 1.0;
+    return ((i == 1 || i == p.Lx) ? 0.5 : 1.0) * ((j == 1 || j == p.Ly) ? 0.5 : 1.0);
+}
+
+// a -= sum(weight * a) / sum(weight) over the unknowns
+void removeMean(const halogridtype &p, DTMutableDoubleArray &a)
+{
+    double sum = 0, total = 0;
+    for(int j = 1; j <= p.Ly; j++)
+    {
+        for(int i = 1; i <= p.Lx; i++)
+        {
+            sum += nullWeight(p, i, j) * a(i, j);
+            total += nullWeight(p, i, j);
+        }
+    }
+    for(int j = 1; j <= p.Ly; j++)
+        for(int i = 1; i <= p.Lx; i++)
+            a(i, j) -= sum / total;
+}
+
+// Direct solver for the coarsest level.  The singular system is bordered with the constants
+// and the weights, [A 1; w^T 0] [x; mu] = [b; 0], which projects the part of b that is not
+// compatible into mu and picks the solution with w^T x = 0.
+class HaloCoarseSolver
+{
+public:
+    void Factor(const halogridtype &p)
+    {
+        Lx = p.Lx;
+        Ly = p.Ly;
+        double r = (p.dx * p.dx) / (p.dy * p.dy);
+        int unknowns = Lx * Ly;
+        auto number = [&](int i, int j) {return (haloSource(i, Lx, p.bc) - 1) + (haloSource(j, Ly, p.bc) - 1) * Lx;};
+        std::vector<T> coefficients;
+        for(int j = 1; j <= Ly; j++)
+        {
+            for(int i = 1; i <= Lx; i++)
+            {
+                int row = number(i, j);
+                coefficients.push_back(T(row, row, 2.0 + 2.0*r));
+                coefficients.push_back(T(row, number(i-1, j), -1.0));
+                coefficients.push_back(T(row, number(i+1, j), -1.0));
+                coefficients.push_back(T(row, number(i, j-1), -r));
+                coefficients.push_back(T(row, number(i, j+1), -r));
+                coefficients.push_back(T(row, unknowns, 1.0));
+                coefficients.push_back(T(unknowns, row, nullWeight(p, i, j)));
+            }
+        }
+        SpMat A(unknowns + 1, unknowns + 1);
+        A.setFromTriplets(coefficients.begin(), coefficients.end());   // sums the repeated entries
+        lu.compute(A);
+        if (lu.info() != Eigen::Success)
+        {
+            printf("Error: Factorization of the %dx%d coarse grid failed!\n", Lx, Ly);
+            exit(1);
+        }
+        b.resize(unknowns + 1);
+    }
+
+    void Solve(halogridtype &p)
+    {
+        double h2 = p.dx * p.dx;
+        int cnt = 0;
+        for(int j = 1; j <= Ly; j++)
+            for(int i = 1; i <= Lx; i++)
+                b[cnt++] = -h2 * p.f(i, j);
+        b[cnt] = 0;
+        x = lu.solve(b);
+        cnt = 0;
+        for(int j = 1; j <= Ly; j++)
+            for(int i = 1; i <= Lx; i++)
+                p.v(i, j) = x[cnt++];
+    }
+
+private:
+    int Lx = 0, Ly = 0;
+    Eigen::SparseLU<SpMat> lu;
+    Eigen::VectorXd b, x;
+};
+
+// Same as MultigridSolver for Neumann or periodic boundaries on an M x N grid, with the same
+// semi-coarsening of stretched grids.
+class HaloMultigridSolver
+{
+public:
+    explicit HaloMultigridSolver(const MGParameters &_params) : params(_params), depth(0) {}
+
+    void Setup(const DTMesh2DGrid &grid, BoundaryType bc);
+
+    // f is made compatible before solving.  u is the initial guess on entry and the solution with
+    // zero mean on return, with the last row and column equal to the first for periodic boundaries.
+    MGOutputs Solve(const DTDoubleArray &f, DTMutableDoubleArray &u);
+
+private:
+    MGParameters params;
+    int depth;
+    std::vector<halogridtype> Grids;
+    HaloCoarseSolver coarse;
+    std::unique_ptr<ThreadTeam> team;
+};
+
+void HaloMultigridSolver::Setup(const DTMesh2DGrid &grid, BoundaryType bc)
+{
+    std::vector<DTMesh2DGrid> levels = levelGrids(grid, params.coarsest, SemiCoarsening);
+    depth = int(levels.size()) - 1;
+    Grids.assign(depth + 1, halogridtype());
+    for(int d = 0; d <= depth; d++)
+    {
+        const DTMesh2DGrid &levelGrid = levels[d];
+        DTMutableDoubleArray dData(levelGrid.m() + 2, levelGrid.n() + 2);
+        dData = 0;
+        halogridtype &level = Grids[d];
+        level.dx = levelGrid.dx();
+        level.dy = levelGrid.dy();
+        level.bc = bc;
+        level.Lx = (bc == PeriodicBoundary) ? levelGrid.m() - 1 : levelGrid.m();
+        level.Ly = (bc == PeriodicBoundary) ? levelGrid.n() - 1 : levelGrid.n();
+        level.f = dData.Copy();
+        level.v = dData.Copy();
+        level.w = dData;
+    }
+    coarse.Factor(Grids[depth]);
+    ExecutionSettings exec = solverExecution(params, team);
+    for(size_t d = 0; d < Grids.size(); d++)
+        Grids[d].exec = exec;
+}
+
+MGOutputs HaloMultigridSolver::Solve(const DTDoubleArray &f, DTMutableDoubleArray &u)
+{
+    int m = f.m();
+    int n = f.n();
+    if (Grids.empty() || m + 2 != Grids[0].f.m() || n + 2 != Grids[0].f.n() || u.m() != m || u.n() != n)
+    {
+        printf("Error: Solve() called with arrays that do not match the grid of Setup()!\n");
+        exit(1);
+    }
+
+    halogridtype &fine = Grids[0];
+    fine.v = 0;
+    for(int j = 1; j <= fine.Ly; j++)
+    {
+        for(int i = 1; i <= fine.Lx; i++)
+        {
+            fine.f(i, j) = f(i-1, j-1);
+            if (!params.fmg)    // the full multigrid pass builds the solution from scratch
+                fine.v(i, j) = u(i-1, j-1);
+        }
+    }
+    removeMean(fine, fine.f);
+
+    MGOutputs output = runCycles(Grids.data(), depth, params, coarse, false);
+    removeMean(fine, fine.v);
+    fillHalo(fine, fine.v);
+    for(int j = 0; j < n; j++)
+        for(int i = 0; i < m; i++)
+            u(i, j) = fine.v(i+1, j+1);
+    return output;
+}
+
+// Cell-centred multigrid.  The Dirichlet boundary is on the faces of the outer cells, half a
+// cell away from their centres, and the ghost value 2g - u(cell) makes the boundary value g the
+// average of the two.  With 2g kept in the frame the ghost cells never change, the stencil of a
+// cell next to the boundary just gets one more u(cell) on the diagonal per boundary face.
+
+// The diagonal of the stencil of cell (i,j) of an M x N framed array
+inline double cellDiagonal(int i, int j, int M, int N, double cx, double cy)
+{
+    return cx * (2 + (i == 1) + (i == M-2)) + cy * (2 + (j == 1) + (j == N-2));
+}
+
+inline double pointResidualCell(const double *ptr, const double *ptr_f, int M, int N, int i, int j, double cx, double cy)
+{
+    const double *u = ptr + i + j*M;
+    return ptr_f[i + j*M] - (cx * (u[-1] + u[1]) + cy * (u[-M] + u[M]) - cellDiagonal(i, j, M, N, cx, cy) * u[0]);
+}
+
+void jacobiCells(const double *ptr, double *ptr_new, const double *ptr_f, int M, int N, int j0, int j1, double cx, double cy, double omega)
+{
+    for(int j = j0; j < j1; j++)
+    {
+        for(int i = 1; i < M-1; i++)
+        {
+            int k = i + j*M;
+            ptr_new[k] = ptr[k] - omega * pointResidualCell(ptr, ptr_f, M, N, i, j, cx, cy) / cellDiagonal(i, j, M, N, cx, cy);
+        }
+    }
+}
+
+void redBlackSweepCells(double *ptr, const double *ptr_f, int M, int N, int j0, int j1, double cx, double cy, double omega, int colour)
+{
+    for(int j = j0; j < j1; j++)
+    {
+        for(int i = 2 - (j + colour) % 2; i < M-1; i += 2)
+        {
+            int k = i + j*M;
+            ptr[k] -= omega * pointResidualCell(ptr, ptr_f, M, N, i, j, cx, cy) / cellDiagonal(i, j, M, N, cx, cy);
+        }
+    }
+}
+
+void relax(cellgridtype &p, int Niter, double omega, SmootherType smoother, bool reverse = false)
+{
+    int M = p.v.m();
+    int N = p.v.n();
+    double cx = 1.0 / (p.dx * p.dx);
+    double cy = 1.0 / (p.dy * p.dy);
+    double *ptr = p.v.Pointer();
+    double *ptr_new = p.w.Pointer();
+    const double *ptr_f = p.f.Pointer();
+    if (smoother == JacobiSmoother)
+    {
+        parallelSweeps(p.exec, M, 1, N-1, Niter, [=](int iter, int j0, int j1) {
+            if (iter % 2 == 0)
+                jacobiCells(ptr, ptr_new, ptr_f, M, N, j0, j1, cx, cy, omega);
+            else
+                jacobiCells(ptr_new, ptr, ptr_f, M, N, j0, j1, cx, cy, omega);
+        });
+        if (Niter % 2 == 1)
+            std::swap(p.v, p.w);
+    }
+    else
+    {
+        if (smoother == GaussSeidelSmoother) omega = 1.0;
+        int firstColour = reverse ? 1 : 0;
+        parallelSweeps(p.exec, M, 1, N-1, 2 * Niter, [=](int sweep, int j0, int j1) {
+            redBlackSweepCells(ptr, ptr_f, M, N, j0, j1, cx, cy, omega, (sweep + firstColour) % 2);
+        });
+    }
+}
+
+// The number of fine cells per coarse cell in a direction with M fine and Mc coarse framed
+// values, 1 when the direction was not coarsened and 2 when it was
+inline int cellRatio(int M, int Mc)
+{
+    return (M - 2) / (Mc - 2);
+}
+
+// Agglomeration, the coarse cell (I,J) gets the average over the ci x cj fine cells it is made
+// of.  ci and cj are 1 or 2, and not both 1.
+template <class Value>
+void agglomerate(const ExecutionSettings &exec, const Value &value, double *ptr_c, int Mc, int Nc, int ci, int cj)
+{
+    parallelColumns(exec, Mc, 1, Nc-1, [&](int J0, int J1) {
+        for(int J = J0; J < J1; J++)
+        {
+            double *c = ptr_c + J*Mc;
+            if (ci == 2 && cj == 2)
+                for(int I = 1; I < Mc-1; I++)
+                    c[I] = 0.25 * (value(2*I-1, 2*J-1) + value(2*I, 2*J-1) + value(2*I-1, 2*J) + value(2*I, 2*J));
+            else if (ci == 2)
+                for(int I = 1; I < Mc-1; I++)
+                    c[I] = 0.5 * (value(2*I-1, J) + value(2*I, J));
+            else
+                for(int I = 1; I < Mc-1; I++)
+                    c[I] = 0.5 * (value(I, 2*J-1) + value(I, 2*J));
+        }
+    });
+}
+
+void restrictResidual(const cellgridtype &p, cellgridtype &coarse)
+{
+    int M = p.v.m();
+    int N = p.v.n();
+    double cx = 1.0 / (p.dx * p.dx);
+    double cy = 1.0 / (p.dy * p.dy);
+    const double *ptr = p.v.Pointer();
+    const double *ptr_f = p.f.Pointer();
+    int Mc = coarse.f.m();
+    int Nc = coarse.f.n();
+    agglomerate(p.exec, [=](int i, int j) {return pointResidualCell(ptr, ptr_f, M, N, i, j, cx, cy);}, coarse.f.Pointer(), Mc, Nc,
+                cellRatio(M, Mc), cellRatio(N, Nc));
+}
+
+void restrictRHS(const cellgridtype &fine, cellgridtype &coarse)
+{
+    int M = fine.f.m();
+    int N = fine.f.n();
+    int Mc = coarse.f.m();
+    int Nc = coarse.f.n();
+    const double *ptr_f = fine.f.Pointer();
+    agglomerate(fine.exec, [=](int i, int j) {return ptr_f[i + j*M];}, coarse.f.Pointer(), Mc, Nc, cellRatio(M, Mc), cellRatio(N, Nc));
+}
+
+// Bilinear interpolation between the cell centres, a fine cell gets 3/4 of its parent and 1/4 of
+// the next coarse cell in each coarsened direction.  Next to the boundary the ghost value
+// frame - parent stands in for the coarse cell, which is minus the parent for a correction.  A
+// direction that was not coarsened takes the parent only.
+void interpolateCorrection(const cellgridtype &coarse, cellgridtype &p)
+{
+    int M = p.v.m();
+    int N = p.v.n();
+    int Mc = coarse.v.m();
+    int Nc = coarse.v.n();
+    int ci = cellRatio(M, Mc);
+    int cj = cellRatio(N, Nc);
+    const double *c = coarse.v.Pointer();
+    double *ptr = p.v.Pointer();
+    parallelColumns(p.exec, M, 1, N-1, [=](int j0, int j1) {
+        for(int j = j0; j < j1; j++)
+        {
+            int J = (cj == 2) ? (j + 1) / 2 : j;
+            int Jy = (j % 2 == 1) ? J-1 : J+1;
+            bool yFrame = (Jy == 0 || Jy == Nc-1);
+            for(int i = 1; i < M-1; i++)
+            {
+                int I = (ci == 2) ? (i + 1) / 2 : i;
+                int Ix = (i % 2 == 1) ? I-1 : I+1;
+                bool xFrame = (Ix == 0 || Ix == Mc-1);
+                double parent = c[I + J*Mc];
+                double row = parent;
+                if (ci == 2)
+                    row = 0.75 * parent + 0.25 * (xFrame ? c[Ix + J*Mc] - parent : c[Ix + J*Mc]);
+                if (cj == 1)
+                {
+                    ptr[i + j*M] += row;
+                    continue;
+                }
+                double next;
+                if (ci == 1)
+                    next = yFrame ? c[I + Jy*Mc] - row : c[I + Jy*Mc];
+                else if (!yFrame)
+                    next = 0.75 * c[I + Jy*Mc] + 0.25 * (xFrame ? c[Ix + Jy*Mc] - c[I + Jy*Mc] : c[Ix + Jy*Mc]);
+                else
+                    next = (xFrame ? c[I + Jy*Mc] : 0.75 * c[I + Jy*Mc] + 0.25 * c[Ix + Jy*Mc]) - row;
+                ptr[i + j*M] += 0.75 * row + 0.25 * next;
+            }
+        }
+    });
+}
+
+double residualNorm(const cellgridtype &p)
+{
+    int M = p.v.m();
+    int N = p.v.n();
+    double cx = 1.0 / (p.dx * p.dx);
+    double cy = 1.0 / (p.dy * p.dy);
+    const double *ptr = p.v.Pointer();
+    const double *ptr_f = p.f.Pointer();
+    std::atomic<double> norm(0.0);
+    parallelColumns(p.exec, M, 1, N-1, [&](int j0, int j1) {
+        double local = 0;
+        for(int j = j0; j < j1; j++)
+            for(int i = 1; i < M-1; i++)
+                local = std::max(local, std::fabs(pointResidualCell(ptr, ptr_f, M, N, i, j, cx, cy)));
+        double current = norm.load();
+        while (local > current && !norm.compare_exchange_weak(current, local));
+    });
+    return norm.load();
+}
+
+// A coarse face is made of two fine faces, its frame value is their average
+void injectBoundary(const cellgridtype &fine, cellgridtype &coarse)
+{
+    const DTMutableDoubleArray &u = fine.v;
+    int Mc = coarse.v.m();
+    int Nc = coarse.v.n();
+    int M = u.m();
+    int N = u.n();
+    int ci = cellRatio(M, Mc);
+    int cj = cellRatio(N, Nc);
+    for(int J = 1; J < Nc-1; J++)
+    {
+        double left = 0, right = 0;
+        for(int b = cj-1; b >= 0; b--)
+        {
+            left += u(0, cj*J - b);
+            right += u(M-1, cj*J - b);
+        }
+        coarse.v(0, J) = coarse.w(0, J) = left / cj;
+        coarse.v(Mc-1, J) = coarse.w(Mc-1, J) = right / cj;
+    }
+    for(int I = 1; I < Mc-1; I++)
+    {
+        double bottom = 0, top = 0;
+        for(int a = ci-1; a >= 0; a--)
+        {
+            bottom += u(ci*I - a, 0);
+            top += u(ci*I - a, N-1);
+        }
+        coarse.v(I, 0) = coarse.w(I, 0) = bottom / ci;
+        coarse.v(I, Nc-1) = coarse.w(I, Nc-1) = top / ci;
+    }
+}
+
+// Direct solver for the coarsest cell-centred level, factored once in Factor()
+class CellCoarseSolver
+{
+public:
+    CellCoarseSolver() : M(0), N(0), r(1.0) {}
+
+    // M x N framed arrays, r = dx^2/dy^2
+    void Factor(int m, int n, double _r)
+    {
+        M = m;
+        N = n;
+        r = _r;
+        int cells = M-2;
+        std::vector<T> coefficients;
+        for(int j = 1; j < N-1; j++)
+        {
+            for(int i = 1; i < M-1; i++)
+            {
+                int row = (i-1) + (j-1)*cells;
+                coefficients.push_back(T(row, row, cellDiagonal(i, j, M, N, 1.0, r)));
+                if (i > 1) coefficients.push_back(T(row, row-1, -1.0));
+                if (i < M-2) coefficients.push_back(T(row, row+1, -1.0));
+                if (j > 1) coefficients.push_back(T(row, row-cells, -r));
+                if (j < N-2) coefficients.push_back(T(row, row+cells, -r));
+            }
+        }
+        SpMat A(cells*(N-2), cells*(N-2));
+        A.setFromTriplets(coefficients.begin(), coefficients.end());
+        chol.compute(A);
+        if (chol.info() != Eigen::Success)
+        {
+            printf("Error: Factorization of the %dx%d coarse grid failed!\n", M-2, N-2);
+            exit(1);
+        }
+        b.resize(cells*(N-2));
+        x.resize(cells*(N-2));
+    }
+
+    void Solve(cellgridtype &p);
+
+private:
+    int M, N;
+    double r;
+    Eigen::SimplicialCholesky<SpMat> chol;
+    Eigen::VectorXd b, x;
+};
+
+void CellCoarseSolver::Solve(cellgridtype &p)
+{
+    DTMutableDoubleArray &u = p.v;
+    assert(u.m() == M && u.n() == N);
+    double h2 = p.dx * p.dx;
+
+    // Right hand side, with the frame values moved over
+    int cnt = 0;
+    for(int j = 1; j < N-1; j++)
+    {
+        for(int i = 1; i < M-1; i++)
+        {
+            double rhs = -h2 * p.f(i, j);
+            if (i == 1) rhs += u(0, j);
+            if (i == M-2) rhs += u(M-1, j);
+            if (j == 1) rhs += r * u(i, 0);
+            if (j == N-2) rhs += r * u(i, N-1);
+            b[cnt++] = rhs;
+        }
+    }
+    x = chol.solve(b);
+    cnt = 0;
+    for(int j = 1; j < N-1; j++)
+        for(int i = 1; i < M-1; i++)
+            u(i, j) = x[cnt++];
+}
+
+// A direction of cells is halved while it has an even number of them, more than sqrt(2) times
+// --coarsest
+bool canCoarsenCells(int cells, int coarsest)
+{
+    return cells % 2 == 0 && cells > coarsest * std::sqrt(2.0);
+}
+
+// Same as MultigridSolver for an M x N grid of cells.  Like levelGrids() with SemiCoarsening, a
+// direction is halved only while its cells are not the longer ones, so stretched cells become
+// square on the coarse levels and the point smoothers keep working.  The hierarchy ends when
+// neither direction can be halved.
+class CellCentredSolver
+{
+public:
+    explicit CellCentredSolver(const MGParameters &_params) : params(_params), depth(0) {}
+
+    void Setup(int m, int n, double dx, double dy);
+
+    // f and u are m x n, g is (m+2) x (n+2) with the boundary values on the faces in its frame
+    MGOutputs Solve(const DTDoubleArray &f, const DTDoubleArray &g, DTMutableDoubleArray &u);
+
+private:
+    MGParameters params;
+    int depth;
+    std::vector<cellgridtype> Grids;
+    CellCoarseSolver coarse;
+    std::unique_ptr<ThreadTeam> team;
+};
+
+void CellCentredSolver::Setup(int m, int n, double dx, double dy)
+{
+    Grids.assign(1, cellgridtype());
+    while (true)
+    {
+        DTMutableDoubleArray dData(m + 2, n + 2);
+        dData = 0;
+        cellgridtype &level = Grids.back();
+        level.dx = dx;
+        level.dy = dy;
+        level.f = dData.Copy();
+        level.v = dData.Copy();
+        level.w = dData;
+        bool cx = canCoarsenCells(m, params.coarsest) && dx <= dy;
+        bool cy = canCoarsenCells(n, params.coarsest) && dy <= dx;
+        if (!cx && !cy)
+            break;
+        if (cx)
+        {
+            m /= 2;
+            dx *= 2.0;
+        }
+        if (cy)
+        {
+            n /= 2;
+            dy *= 2.0;
+        }
+        Grids.push_back(cellgridtype());
+    }
+    // A direction with an odd number of cells can not be halved, see checkCoarsest()
+    double limit = params.coarsest * std::sqrt(2.0);
+    bool parity = (m % 2 != 0 && m > limit) || (n % 2 != 0 && n > limit);
+    refuseCoarsest({m, n}, parity, "cells");
+    depth = int(Grids.size()) - 1;
+    coarse.Factor(Grids[depth].v.m(), Grids[depth].v.n(), (dx * dx) / (dy * dy));
+    ExecutionSettings exec = solverExecution(params, team);
+    for(size_t d = 0; d < Grids.size(); d++)
+        Grids[d].exec = exec;
+}
+
+MGOutputs CellCentredSolver::Solve(const DTDoubleArray &f, const DTDoubleArray &g, DTMutableDoubleArray &u)
+{
+    int m = f.m();
+    int n = f.n();
+    if (Grids.empty() || m + 2 != Grids[0].f.m() || n + 2 != Grids[0].f.n() || u.m() != m || u.n() != n ||
+        g.m() != m + 2 || g.n() != n + 2)
+    {
+        printf("Error: Solve() called with arrays that do not match the grid of Setup()!\n");
+        exit(1);
+    }
+
+    cellgridtype &fine = Grids[0];
+    fine.v = 0;
+    for(int j = 0; j < n + 2; j++)
+    {
+        for(int i = 0; i < m + 2; i++)
+        {
+            if (i == 0 || i == m+1 || j == 0 || j == n+1)
+                fine.v(i, j) = 2.0 * g(i, j);
+            else
+            {
+                fine.f(i, j) = f(i-1, j-1);
+                if (!params.fmg)    // the full multigrid pass builds the solution from scratch
+                    fine.v(i, j) = u(i-1, j-1);
+            }
+        }
+    }
+    CopyValues(fine.w, fine.v);
+
+    MGOutputs output = runCycles(Grids.data(), depth, params, coarse, false);
+    for(int j = 0; j < n; j++)
+        for(int i = 0; i < m; i++)
+            u(i, j) = fine.v(i+1, j+1);
+    return output;
+}
+
+int main(int argc,const char *argv[])
+{
+    // Parse program parameters
+    po::options_description desc( "Allowed options" );
+    desc.add_options()
+            ( "help,h", "produce help message" )
+            ( "Nv,v", po::value< int >()->default_value( 100 ), "maximum number of cycles to sweep")
+            ( "cycle", po::value< std::string >()->default_value( "v" ), "cycle type: v, w or f" )
+            ( "Nbefore,b", po::value< int >()->default_value( 3 ), "number of smoothing sweeps before refinement" )
+            ( "Nafter,a", po::value< int >()->default_value( 3 ), "number of smoothing sweeps after refinement" )
+            ( "omega,o", po::value< double >()->default_value( 0.6 ), "relaxation parameter (Jacobi weight or SOR factor)" )
+            ( "smoother,s", po::value< std::string >()->default_value( "jacobi" ), "smoother: jacobi, gs (red-black Gauss-Seidel), sor (red-black SOR) or line (zebra line Gauss-Seidel along the smaller spacing, 2D only)" )
+            ( "coarsest,c", po::value< int >()->default_value( 2 ), "threshold dimension to use a direct solver, larger than 2 uses a cached Cholesky factorization" )
+            ( "fmg,f", po::bool_switch()->default_value( false ), "start with a full multigrid pass (counts as the first cycle)" )
+            ( "Nfmg", po::value< int >()->default_value( 1 ), "number of cycles per level in the full multigrid pass" )
+            ( "rtol", po::value< double >()->default_value( 0.0 ), "stop when the residual norm drops below rtol times the initial residual norm" )
+            ( "atol", po::value< double >()->default_value( 0.0 ), "stop when the residual norm drops below atol" )
+            ( "threads,t", po::value< int >()->default_value( 1 ), "number of threads for the stencil kernels" )
+            ( "paralleldim", po::value< int >()->default_value( 129 ), "threshold dimension below which kernels run on one thread" )
+            ( "simd", po::value< std::string >()->default_value( "auto" ), "stencil kernels: auto, scalar, sse2, avx2 or avx512" )
+            ( "tblock", po::value< int >()->default_value( 1 ), "Jacobi sweeps per cache blocked pass over a level, 1 disables temporal blocking" )
+            ( "tilekb", po::value< int >()->default_value( 256 ), "cache size in KB a temporally blocked tile should fit in" )
+            ( "mgcg", po::bool_switch()->default_value( false ), "conjugate gradients preconditioned by one symmetric V cycle per iteration" )
+            ( "mixed", po::bool_switch()->default_value( false ), "single precision cycles with iterative refinement in double precision" )
+            ( "coarseop", po::value< std::string >()->default_value( "galerkin" ), "coarse operators for a coefficient a in Input.mat: galerkin or harmonic" )
+            ( "fas", po::bool_switch()->default_value( false ), "solve the nonlinear Laplacian(u) - lambda e^u = f with full approximation scheme cycles" )
+            ( "lambda", po::value< double >()->default_value( 1.0 ), "coefficient of the nonlinear term with --fas" )
+            ( "cellcentred", po::bool_switch()->default_value( false ), "f holds the values at the centres of M x N cells, the boundary is on the outer cell faces" )
+            ( "coarsesolver", po::value< std::string >()->default_value( "cholesky" ), "direct solver for the coarsest level: cholesky or dst (sine transforms, no fill-in, the 2D Laplacian with Dirichlet boundaries only)" )
+            ( "groundtruth", po::bool_switch()->default_value( false ), "also solve with the sine transform direct solver, save it as Groundtruth and print the largest difference to Sol" )
+            ( "bc", po::value< std::string >()->default_value( "dirichlet" ), "boundary conditions: dirichlet (values of the boundary function), neumann (zero normal derivative) or periodic" )
+            ( "batched", po::bool_switch()->default_value( false ), "f is M x N x K, solve the K systems together and save an M x N x K Sol" );
+
+
+    po::positional_options_description _p;
+    _p.add( "Nv", 1 );
+
+    po::variables_map vm;
+    po::store( po::command_line_parser( argc, argv ).options( desc ).positional( _p ).run(), vm );
+
+    if ( vm.count( "help" ))
+    {
+        std::cout << desc << "\n";
+        return 0;
+    }
+
+    int Nv = vm["Nv"].as< int >();
+    int Ndown = vm["Nbefore"].as< int >();
+    int Nup = vm["Nafter"].as< int >();
     double omega = vm["omega"].as< double >();
     int coarsest = vm["coarsest"].as< int >();
+    int threads = std::max(1, vm["threads"].as< int >());
+    BlockingSettings blocking;
+    blocking.sweeps = std::min(std::max(1, vm["tblock"].as< int >()), MaxBlockedSweeps);
+    blocking.cacheBytes = std::max(1, vm["tilekb"].as< int >()) * 1024;
+    std::string simdName = vm["simd"].as< std::string >();
+    const StencilKernels *kernels = SelectStencilKernels(simdName);
+    if (kernels == nullptr)
+    {
+        printf("Error: \"%s\" kernels are not supported on this machine!\n", simdName.c_str());
+        exit(1);
+    }
+    std::string smootherName = vm["smoother"].as< std::string >();
+    SmootherType smoother;
+    if (smootherName == "jacobi")
+        smoother = JacobiSmoother;
+    else if (smootherName == "gs")
+        smoother = GaussSeidelSmoother;
+    else if (smootherName == "sor")
+        smoother = SORSmoother;
+    else if (smootherName == "line")
+        smoother = LineSmoother;
+    else
+    {
+        printf("Error: Unknown smoother \"%s\"!\n", smootherName.c_str());
+        exit(1);
+    }
 
 //    DTSetArguments(argc, argv);
 
     DTMatlabDataFile inputFile("Input.mat", DTFile::ReadOnly);
     // Read in the input variables.
-    DTMesh2D f;
-    Read(inputFile, "f", f);
-
-//    DTMutableDoubleArray groundtruth = getSparseSol(f, boundary_func);
+    bool batched = vm["batched"].as< bool >();
+    bool volume = !batched && inputFile.Contains("f_3D");   // a 3D f is a 3D problem unless --batched
+    DTMesh2DGrid grid;
+    DTDoubleArray fData;
+    if (batched || volume)
+    {
+        // DTMesh2D can not hold a 3D array, read the values and the grid separately.  In 3D
+        // f_loc gives the origin in x and y and the side of the cubes, z starts at 0.
+        Read(inputFile, "f", fData);
+        if (inputFile.Contains("f_loc"))
+        {
+            Read(inputFile, "f_loc", grid);
+            grid = ChangeSize(grid, fData.m(), fData.n());
+        }
+        else
+        {
+            grid = DTMesh2DGrid(fData.m(), fData.n());
+        }
+    }
+    else
+    {
+        DTMesh2D f;
+        Read(inputFile, "f", f);
+        grid = f.Grid();
+        fData = f.DoubleData();
+    }
 
-    DTMesh2DGrid grid = f.Grid();
+    // An optional coefficient a on the grid of f turns the equation into div(a grad u) = f
+    DTDoubleArray aData;
+    if (inputFile.Contains("a"))
+    {
+        DTMesh2D a;
+        Read(inputFile, "a", a);
+        aData = a.DoubleData();
+        if (batched || volume || aData.m() != fData.m() || aData.n() != fData.n())
+        {
+            printf("Error: a has to be a 2D mesh of the same size as f!\n");
+            exit(1);
+        }
+        for(int k = 0; k < aData.Length(); k++)
+        {
+            if (!(aData(k) > 0))
+            {
+                printf("Error: a has to be positive!\n");
+                exit(1);
+            }
+        }
+    }
 
-    double h = grid.dx();
-    double h2 = h * h;
-    DTDoubleArray fData = f.DoubleData();
+    double dx = grid.dx();
+    double dy = grid.dy();
 
     int M = fData.m();
     int N = fData.n();
-    if (M != N)
+    int K = fData.o();   // number of systems in batched mode, or of planes in 3D
+    if (fData.IsEmpty())
+    {
+        printf("Error: Could not read f from Input.mat!\n");
+        exit(1);
+    }
+    if (M < 3 || N < 3 || (volume && K < 3))
     {
-        printf("Error: Input is not square matrix!\n");
+        printf("Error: Input needs at least 3 rows and columns%s!\n", volume ? " and planes" : "");
         exit(1);
     }
-    if (M % 2 == 0)
+    if (volume && dx != dy)
     {
-        printf("Error: Input has even rows and columns!\n");
+        printf("Error: 3D input needs dx == dy!\n");
         exit(1);
     }
 
     // Set initial guess to all zeros
-    DTMutableDoubleArray u(M, N);
+    DTMutableDoubleArray u(M, N, K);
     u = 0;
 
     // Set the boundary of u to the values of g
     double xzero = grid.Origin().x;
     double yzero = grid.Origin().y;
-    double xm = xzero + (M-1)*h;
-    double yn = yzero + (N-1)*h;
+    double xm = xzero + (M-1)*dx;
+    double yn = yzero + (N-1)*dy;
+    if (volume)
+    {
+        for (int k = 0; k < K; k++)
+            for (int j = 0; j < N; j++)
+                for (int i = 0; i < M; i++)
+                    if (i == 0 || i == M-1 || j == 0 || j == N-1 || k == 0 || k == K-1)
+                        u(i,j,k) = boundary_func3D(xzero + i*dx, yzero + j*dy, k*dx);
+    }
     // fill boundary rows
-    for (int j = 0; j < N; j++) {
-        double y = yzero + j*h;
-        u(0,j) = boundary_func(xzero, y);
-        u(M-1,j) = boundary_func(xm, y);
+    for (int r = 0; r < K && !volume; r++) {
+        for (int j = 0; j < N; j++) {
+            double y = yzero + j*dy;
+            u(0,j,r) = boundary_func(xzero, y);
+            u(M-1,j,r) = boundary_func(xm, y);
+        }
+        // fill boundary columns
+        for (int i = 0; i < M; i++) {
+            double x = xzero + i*dx;
+            u(i,0,r) = boundary_func(x, yzero);
+            u(i,N-1,r) = boundary_func(x, yn);
+        }
     }
-    // fill boundary columns
-    for (int i = 0; i < M; i++) {
-        double x = xzero + i*h;
-        u(i,0) = boundary_func(x, yzero);
-        u(i,N-1) = boundary_func(x, yn);
+
+
+    // In a masked domain the points of the domain next to the outside carry Dirichlet values
+    // too, and the solution is 0 outside of the domain
+    if (grid.MaskDefined())
+    {
+        DTCharArray domain = grid.Mask().MaskArray();
+        for (int j = 1; j < N-1; j++) {
+            for (int i = 1; i < M-1; i++) {
+                if (!domain(i, j))
+                    continue;
+                if (!domain(i-1, j) || !domain(i+1, j) || !domain(i, j-1) || !domain(i, j+1))
+                    u(i, j, 0) = boundary_func(xzero + i*dx, yzero + j*dy);
+            }
+        }
+        for (int j = 0; j < N; j++)
+            for (int i = 0; i < M; i++)
+                if (!domain(i, j))
+                    u(i, j, 0) = 0;
     }
 
+    std::string cycleName = vm["cycle"].as< std::string >();
+    CycleType cycle;
+    if (cycleName == "v")
+        cycle = VCycle;
+    else if (cycleName == "w")
+        cycle = WCycle;
+    else if (cycleName == "f")
+        cycle = FCycle;
+    else
+    {
+        printf("Error: Unknown cycle type \"%s\"!\n", cycleName.c_str());
+        exit(1);
+    }
 
-    gridtype problem;
-    problem.f = DTMutableMesh2D(grid, fData.Copy());
-    problem.v = DTMutableMesh2D(grid, u.Copy());
-    auto output = MultiGrid(problem, Nv, Ndown, Nup, omega, coarsest, 0);
+    MGParameters params;
+    params.Nv = Nv;
+    params.Ndown = Ndown;
+    params.Nup = Nup;
+    params.omega = omega;
+    params.coarsest = coarsest;
+    params.smoother = smoother;
+    params.cycle = cycle;
+    params.fmg = vm["fmg"].as< bool >();
+    params.Nfmg = std::max(1, vm["Nfmg"].as< int >());
+    params.rtol = vm["rtol"].as< double >();
+    params.atol = vm["atol"].as< double >();
+    params.mgcg = vm["mgcg"].as< bool >();
+    params.symmetric = params.mgcg;
+    params.mixed = vm["mixed"].as< bool >();
+    params.fas = vm["fas"].as< bool >();
+    params.lambda = vm["lambda"].as< double >();
+    params.threads = threads;
+    params.parallelDim = vm["paralleldim"].as< int >();
+    params.blocking = blocking;
+    params.kernels = kernels;
+    std::string coarseopName = vm["coarseop"].as< std::string >();
+    if (coarseopName == "galerkin")
+        params.coarseop = GalerkinOperator;
+    else if (coarseopName == "harmonic")
+        params.coarseop = HarmonicAveraging;
+    else
+    {
+        printf("Error: Unknown coarse operator \"%s\"!\n", coarseopName.c_str());
+        exit(1);
+    }
+    if (!aData.IsEmpty() && (params.mixed || smoother == LineSmoother))
+    {
+        printf("Error: A coefficient a can not be combined with --mixed or --smoother line!\n");
+        exit(1);
+    }
+    if ((params.mixed || batched) && dx != dy)
+    {
+        printf("Error: --mixed and --batched need dx == dy!\n");
+        exit(1);
+    }
+    if (params.mixed && (params.mgcg || batched))
+    {
+        printf("Error: --mixed can not be combined with --mgcg or --batched!\n");
+        exit(1);
+    }
+    if (params.mgcg && (Ndown != Nup || params.fmg || batched))
+    {
+        printf("Error: --mgcg needs as many smoothing sweeps after as before, and no --fmg or --batched!\n");
+        exit(1);
+    }
+    if (smoother == LineSmoother && (batched || params.mixed || volume))
+    {
+        printf("Error: --smoother line can not be combined with --batched, --mixed or 3D input!\n");
+        exit(1);
+    }
+    if (volume && (params.mgcg || params.mixed))
+    {
+        printf("Error: --mgcg and --mixed are not supported for 3D input!\n");
+        exit(1);
+    }
+    bool cellCentred = vm["cellcentred"].as< bool >();
+    if (cellCentred && (batched || volume || params.mgcg || params.mixed || params.fas || grid.MaskDefined() || !aData.IsEmpty() || smoother == LineSmoother))
+    {
+        printf("Error: --cellcentred can not be combined with --batched, 3D input, --mgcg, --mixed, --fas, a mask, a coefficient a or --smoother line!\n");
+        exit(1);
+    }
+    BoundaryType bc = DirichletBoundary;
+    std::string bcName = vm["bc"].as< std::string >();
+    if (bcName == "neumann")
+        bc = NeumannBoundary;
+    else if (bcName == "periodic")
+        bc = PeriodicBoundary;
+    else if (bcName != "dirichlet")
+    {
+        printf("Error: Unknown boundary conditions %s, use dirichlet, neumann or periodic!\n", bcName.c_str());
+        exit(1);
+    }
+    if (bc != DirichletBoundary && (batched || volume || params.mgcg || params.mixed || params.fas || cellCentred || grid.MaskDefined() || !aData.IsEmpty() || smoother == LineSmoother))
+    {
+        printf("Error: --bc %s can not be combined with --batched, 3D input, --mgcg, --mixed, --fas, --cellcentred, a mask, a coefficient a or --smoother line!\n", bcName.c_str());
+        exit(1);
+    }
+    if (grid.MaskDefined() && (params.mgcg || params.mixed || params.fas || !aData.IsEmpty() || smoother == LineSmoother))
+    {
+        printf("Error: A masked f can not be combined with --mgcg, --mixed, --fas, a coefficient a or --smoother line!\n");
+        exit(1);
+    }
+    if (params.fas && (params.mgcg || params.mixed || batched || volume || !aData.IsEmpty() || smoother == LineSmoother))
+    {
+        printf("Error: --fas can not be combined with --mgcg, --mixed, --batched, 3D input, a coefficient a or --smoother line!\n");
+        exit(1);
+    }
+    std::string coarseSolverName = vm["coarsesolver"].as< std::string >();
+    if (coarseSolverName == "dst")
+        params.sineCoarse = true;
+    else if (coarseSolverName == "cholesky")
+        params.sineCoarse = false;
+    else
+    {
+        printf("Error: Unknown coarse solver \"%s\"!\n", coarseSolverName.c_str());
+        exit(1);
+    }
+    bool groundtruthWanted = vm["groundtruth"].as< bool >();
+    if ((params.sineCoarse || groundtruthWanted) && (volume || params.fas || cellCentred || bc != DirichletBoundary || grid.MaskDefined() || !aData.IsEmpty()))
+    {
+        printf("Error: --coarsesolver dst and --groundtruth need the 2D Laplacian with Dirichlet boundaries, without 3D input, --fas, --cellcentred, --bc, a mask or a coefficient a!\n");
+        exit(1);
+    }
+    if (groundtruthWanted && batched)
+    {
+        printf("Error: --groundtruth can not be combined with --batched!\n");
+        exit(1);
+    }
+    DTDoubleArray empty;
+    MGOutputs output(empty, empty, empty);
+    if (cellCentred)
+    {
+        // The boundary values on the faces of the outer cells, in the frame around the cells
+        DTMutableDoubleArray g(M+2, N+2);
+        g = 0;
+        for (int j = 0; j < N; j++) {
+            double y = yzero + j*dy;
+            g(0,j+1) = boundary_func(xzero - 0.5*dx, y);
+            g(M+1,j+1) = boundary_func(xm + 0.5*dx, y);
+        }
+        for (int i = 0; i < M; i++) {
+            double x = xzero + i*dx;
+            g(i+1,0) = boundary_func(x, yzero - 0.5*dy);
+            g(i+1,N+1) = boundary_func(x, yn + 0.5*dy);
+        }
+        CellCentredSolver solver(params);
+        solver.Setup(M, N, dx, dy);
+        output = solver.Solve(fData, g, u);
+    }
+    else if (bc != DirichletBoundary)
+    {
+        // The boundary values of u are ignored, only the part of f with zero mean is solved for
+        HaloMultigridSolver solver(params);
+        solver.Setup(grid, bc);
+        output = solver.Solve(fData, u);
+    }
+    else if (volume)
+    {
+        Multigrid3DSolver solver(params);
+        solver.Setup(M, N, K, dx);
+        output = solver.Solve(fData, u);
+    }
+    else if (batched)
+    {
+        BatchedMultigridSolver solver(params);
+        solver.Setup(grid, K);
+        output = solver.Solve(fData, u);
+    }
+    else
+    {
+        MultigridSolver solver(params);
+        solver.Setup(grid, aData);
+        output = solver.Solve(fData, u);
+    }
 
-//    auto mgres = calcNorm(residual(problem));
-//    problem.v = DTMutableMesh2D(grid, groundtruth.Copy());
-//    auto gdres = calcNorm(residual(problem));
-//    printf("MGres=%.20f\ngdres=%.20f\n", mgres, gdres);
+    // Error against the exact solution of the discrete problem
+    DTDoubleArray groundtruth;
+    if (groundtruthWanted)
+    {
+        ThreadTeam team(threads);
+        DTTimer timer;
+        timer.Start();
+        groundtruth = getFastSol(DTMesh2D(grid, fData), boundary_func, &team);
+        double time = timer.Stop();
+        printf("max|Sol-Groundtruth|=%.6e (direct solve %.3fs)\n", calcNorm(u - groundtruth), time);
+    }
 
     DTMatlabDataFile outputFile("Output.mat",DTFile::NewReadWrite);
-    outputFile.Save(problem.v.DoubleData(), "Sol");
+    outputFile.Save(u, "Sol");
     outputFile.Save(output.ResidualNorms, "ResNorms");
     outputFile.Save(output.Times, "Times");
-//    outputFile.Save(groundtruth, "Groundtruth");
+    outputFile.Save(output.LevelTimes, "LevelTimes");
+    if (groundtruthWanted)
+        outputFile.Save(groundtruth, "Groundtruth");
 
     return 0;
 }
\ No newline at end of file